@@ -0,0 +1,344 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * Microbenchmarks for the hot functions of breaktext: utf_char2cells
+ * and intable on different code point distributions, break_text with
+ * output discarded, and breaking short strings one by one or with
+ * break_batch.
+ *
+ * Usage: bench [Runs]
+ *
+ * Each measurement is warmed up once, repeated the given number of times
+ * (9 by default), and the best and median results are reported.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#elif defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <intrin.h>
+#define HAVE_RDTSC
+#endif
+
+/* Output of break_text is discarded, but still costs a call */
+static unsigned long null_count;
+static void null_putwc(wchar_t ch, FILE *fp)
+{
+    (void)fp;
+    null_count += ch;
+}
+
+#undef putwc
+#define putwc(ch, fp) null_putwc(ch, fp)
+
+#define BREAKTEXT_NO_MAIN
+#include "breaktext.c"
+
+#define BENCH_CHARS (1024*1024)
+
+struct distribution
+{
+    const char *name;
+    int first;
+    int last;
+};
+
+static struct distribution distributions[] =
+{
+    {"ASCII",   0x20,    0x7e},
+    {"Latin-1", 0xa0,    0xff},
+    {"CJK",     0x4e00,  0x9fff},
+    {"Emoji",   0x1f300, 0x1f64f},
+    {"Astral",  0x10000, 0x3fffd}
+};
+
+static int codes[BENCH_CHARS];
+static int runs = 9;
+static volatile int bench_sink;
+
+struct result
+{
+    double best_ns;
+    double median_ns;
+    double best_cycles;
+};
+
+static unsigned long long cycles(void)
+{
+#ifdef HAVE_RDTSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void fill_codes(struct distribution *dist)
+{
+    size_t i;
+    unsigned long seed = 1;
+
+    for (i = 0; i < BENCH_CHARS; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        codes[i] = dist->first +
+                   (int)((seed >> 8) % (unsigned long)(dist->last -
+                                                       dist->first + 1));
+    }
+}
+
+/*
+ * Run "func" (warmed up once) "runs" times, each over "chars"
+ * characters, and collect the per-character costs.
+ */
+static struct result measure(void (*func)(void), size_t chars)
+{
+    struct result res;
+    double *times = malloc(runs * sizeof(double));
+    double best_cycles = 0;
+    unsigned long long c1, c2;
+    pctimer_t t1, t2;
+    int i;
+
+    if (times == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    func();
+    for (i = 0; i < runs; ++i)
+    {
+        t1 = pctimer();
+        c1 = cycles();
+        func();
+        c2 = cycles();
+        t2 = pctimer();
+        times[i] = (t2 - t1) * 1e9 / chars;
+        if (i == 0 || (double)(c2 - c1) / chars < best_cycles)
+            best_cycles = (double)(c2 - c1) / chars;
+    }
+    qsort(times, runs, sizeof(double), compare_double);
+    res.best_ns = times[0];
+    res.median_ns = times[runs / 2];
+    res.best_cycles = best_cycles;
+    free(times);
+    return res;
+}
+
+static void report(const char *func, const char *name, struct result res)
+{
+    printf("%-16s %-24s %8.2f ns %8.2f ns", func, name,
+           res.best_ns, res.median_ns);
+#ifdef HAVE_RDTSC
+    printf(" %8.2f", res.best_cycles);
+#endif
+    printf("\n");
+}
+
+static void run_char2cells(void)
+{
+    size_t i;
+    int sum = 0;
+
+    for (i = 0; i < BENCH_CHARS; ++i)
+        sum += utf_char2cells(codes[i]);
+    bench_sink = sum;
+}
+
+static struct interval *bench_table;
+static size_t bench_table_size;
+
+static void run_intable(void)
+{
+    size_t i;
+    int sum = 0;
+
+    for (i = 0; i < BENCH_CHARS; ++i)
+        sum += intable(bench_table, bench_table_size, codes[i]);
+    bench_sink = sum;
+}
+
+static size_t text_len;
+static struct file_sink null_sink;
+
+static void run_break_text(void)
+{
+    break_text(buffer, brks, widths, 0, text_len, &null_sink.sink);
+}
+
+#define STRING_CHARS 50
+#define BATCH_SIZE   (BENCH_CHARS / STRING_CHARS)
+
+static const wchar_t *batch_strings[BATCH_SIZE];
+static size_t batch_lengths[BATCH_SIZE];
+static struct text_batch batch;
+
+/* Each string analysed and broken by itself */
+static void run_strings(void)
+{
+    size_t k;
+
+    for (k = 0; k < BATCH_SIZE; ++k)
+    {
+        /* With the line feed, or the last character would be dropped */
+        find_breaks(batch_strings[k], batch_lengths[k] + 1, NULL, brks);
+        set_widths(batch_strings[k], batch_lengths[k] + 1, widths);
+        break_text(batch_strings[k], brks, widths, 0, batch_lengths[k] + 1,
+                   &null_sink.sink);
+    }
+}
+
+static void run_break_batch(void)
+{
+    if (break_batch(&batch, batch_strings, batch_lengths, BATCH_SIZE, NULL,
+                    1) < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+/*
+ * Make a text of characters from the distribution, with spaces between
+ * words (for alphabetic text) and a line feed every "line_len"
+ * characters.
+ */
+static void make_text(struct distribution *dist, size_t line_len)
+{
+    size_t i;
+    unsigned long seed = 1;
+
+    fill_codes(dist);
+    for (i = 0; i < BENCH_CHARS; ++i)
+    {
+        seed = seed * 1103515245 + 12345;
+        if (dist->first < 0x100 && (seed >> 8) % 6 == 0)
+            buffer[i] = L' ';
+        else
+            buffer[i] = (wchar_t)codes[i];
+        if (i % line_len == line_len - 1)
+            buffer[i] = L'\n';
+    }
+    text_len = BENCH_CHARS;
+    find_breaks(buffer, text_len, NULL, brks);
+    set_widths(buffer, text_len, widths);
+}
+
+/* Allocate buffer, brks, and widths of breaktext.c for "chars"
+ * characters */
+static void alloc_text(size_t chars)
+{
+    buffer = calloc(chars, sizeof(wchar_t));
+    brks = calloc(BRKS_SIZE(chars), 1);
+    widths = calloc(chars, 1);
+    if (buffer == NULL || brks == NULL || widths == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct
+    {
+        const char *name;
+        struct interval *table;
+        size_t size;
+    } tables[] =
+    {
+        {"ambiguous",   ambiguous,   sizeof(ambiguous)},
+        {"doublewidth", doublewidth, sizeof(doublewidth)},
+        {"emoji_width", emoji_width, sizeof(emoji_width)}
+    };
+    char name[64];
+    size_t d, t, i;
+
+    if (argc > 1)
+    {
+        runs = atoi(argv[1]);
+        if (runs < 1)
+        {
+            fprintf(stderr, "Invalid number of runs\n");
+            exit(1);
+        }
+    }
+
+    printf("%-16s %-24s %11s %11s", "Function", "Input", "Best/char",
+           "Median/char");
+#ifdef HAVE_RDTSC
+    printf(" %8s", "Cycles");
+#endif
+    printf("\n");
+
+    for (ambw = 1; ambw <= 2; ++ambw)
+    {
+        for (d = 0; d < sizeof distributions / sizeof distributions[0]; ++d)
+        {
+            fill_codes(&distributions[d]);
+            sprintf(name, "%s, ambw=%d", distributions[d].name, ambw);
+            report("utf_char2cells", name,
+                   measure(run_char2cells, BENCH_CHARS));
+        }
+    }
+    ambw = 1;
+
+    for (t = 0; t < sizeof tables / sizeof tables[0]; ++t)
+    {
+        bench_table = tables[t].table;
+        bench_table_size = tables[t].size;
+        for (d = 0; d < sizeof distributions / sizeof distributions[0]; ++d)
+        {
+            fill_codes(&distributions[d]);
+            sprintf(name, "%s, %s", tables[t].name, distributions[d].name);
+            report("intable", name, measure(run_intable, BENCH_CHARS));
+        }
+    }
+
+    init_linebreak();
+    init_file_sink(&null_sink, stdout);
+    /* stdout is byte-oriented after printf, but the output is to go to
+     * null_putwc */
+    null_sink.sink.put_line = file_put_line;
+    alloc_text(BENCH_CHARS);
+    for (width = 20; width <= 80; width += 60)
+    {
+        for (d = 0; d < 3; ++d)
+        {
+            init_widths();
+            make_text(&distributions[d], 300);
+            sprintf(name, "%s, width=%d", distributions[d].name, width);
+            report("break_text", name, measure(run_break_text, text_len));
+        }
+    }
+
+    /* Strings of STRING_CHARS - 1 characters, each before a line feed */
+    text_batch_init(&batch);
+    width = 20;
+    for (d = 0; d < 3; ++d)
+    {
+        init_widths();
+        make_text(&distributions[d], STRING_CHARS);
+        for (i = 0; i < BATCH_SIZE; ++i)
+        {
+            batch_strings[i] = buffer + i * STRING_CHARS;
+            batch_lengths[i] = STRING_CHARS - 1;
+        }
+        sprintf(name, "%s, width=%d", distributions[d].name, width);
+        report("strings", name, measure(run_strings, text_len));
+        report("break_batch", name, measure(run_break_batch, text_len));
+    }
+    text_batch_free(&batch);
+
+    return 0;
+}
@@ -19,22 +19,68 @@
  */
 
 #include <assert.h>
+#include <errno.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <wchar.h>
+#include <wctype.h>
 #include <getopt.h>
+#ifdef _WIN32
+#include <fcntl.h>
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#ifndef _WIN32
+#include <pthread.h>
+#endif
 #include "linebreak.h"
+#include "breaktext.h"
+#include "cjk.h"
+#include "hyphen.h"
 #include "pctimer.h"
+#include "perfcount.h"
+#include "trace.h"
+#include "zio.h"
 
 #define FALSE       0
 #define TRUE        1
 
 #define MAXCHARS    (8*1024*1024)
+#define MAXCHUNK    (64*1024)
+#define MINPARALLEL (256*1024) /* Fewest characters for a wrapping thread */
+#define MINBATCH    (64*1024)  /* Fewest characters for a batch thread */
+#define HUGEPAGE    (2*1024*1024)
+#define MAXLATENCY  24
+#define MAXMETRICS  16
+#define INDEX_MAGIC "BTIX"
+#define OFFSET_MAGIC "BTBO"
+#define OFFSET_INPUT (-1)       /* Code units of the input encoding */
 #define BOM         ((wchar_t)0xFEFF)
 
 #define SWAPBYTE(x) ((((x) & 0xFF00) >> 8) | (((x) & 0x00FF) << 8))
+#define SWAPBYTE32(x) ((((x) & 0xFF000000) >> 24) | \
+                       (((x) & 0x00FF0000) >> 8) | \
+                       (((x) & 0x0000FF00) << 8) | \
+                       (((x) & 0x000000FF) << 24))
+
+/* Input encodings; ENC_LOCALE is read with getwc on Windows, where the
+ * console input is converted */
+#define ENC_AUTO    (-1)
+#define ENC_LOCALE  0
+#define ENC_UTF16LE 1
+#define ENC_UTF16BE 2
+#define ENC_UTF32LE 3
+#define ENC_UTF32BE 4
+#define ENC_CJK     5   /* cjk_codec, also used for output */
 
 int ambw = 1;
 char* locale = "";
@@ -42,9 +88,34 @@ char* lang = NULL;
 int width = 72;
 int keep_indent = 0;
 int verbose = 0;
+int filter = 0;
+int timeout = -1;
+int threads = 1;
+int short_lines = 0;
+int offset_unit = 0;
+int metric_widths[MAXMETRICS];  /* Widths to output the metrics at */
+int metric_count = 0;
+int encoding = ENC_AUTO;
+struct cjk_codec *cjk_codec = NULL;
+struct hyphen_trie *hyphen_trie = NULL;
+int compression = ZIO_NONE;     /* Of the output */
+struct zio *zinput = NULL;      /* Input read with decompression */
+/* Byte range of the input to break with -s; shard_end is 0 without it */
+unsigned long long shard_begin = 0;
+unsigned long long shard_end = 0;
 
-wchar_t buffer[MAXCHARS];
-char brks[MAXCHARS];
+/* Allocated by alloc_buffers for up to MAXCHARS characters (or by the
+ * program, with BREAKTEXT_NO_MAIN) */
+wchar_t *buffer;
+unsigned char *brks;
+unsigned char *widths;
+
+/* Histogram of paragraph latencies in filter mode: paragraphs output
+ * within [2^(n-1), 2^n) microseconds are counted in latencies[n] */
+unsigned long latencies[MAXLATENCY + 1];
+
+/* Cache of the lines of repeated paragraphs, if its capacity is set */
+struct para_cache para_cache;
 
 
 /**********************************************************************
@@ -297,6 +368,166 @@ static struct interval ambiguous[] =
     {0x100000, 0x10fffd}
 };
 
+/* Sorted list of non-overlapping intervals of East Asian double width
+ * characters, generated with ../runtime/tools/unicode.vim. */
+static struct interval doublewidth[] =
+{
+    {0x1100, 0x115f},
+    {0x231a, 0x231b},
+    {0x2329, 0x232a},
+    {0x23e9, 0x23ec},
+    {0x23f0, 0x23f0},
+    {0x23f3, 0x23f3},
+    {0x25fd, 0x25fe},
+    {0x2614, 0x2615},
+    {0x2648, 0x2653},
+    {0x267f, 0x267f},
+    {0x2693, 0x2693},
+    {0x26a1, 0x26a1},
+    {0x26aa, 0x26ab},
+    {0x26bd, 0x26be},
+    {0x26c4, 0x26c5},
+    {0x26ce, 0x26ce},
+    {0x26d4, 0x26d4},
+    {0x26ea, 0x26ea},
+    {0x26f2, 0x26f3},
+    {0x26f5, 0x26f5},
+    {0x26fa, 0x26fa},
+    {0x26fd, 0x26fd},
+    {0x2705, 0x2705},
+    {0x270a, 0x270b},
+    {0x2728, 0x2728},
+    {0x274c, 0x274c},
+    {0x274e, 0x274e},
+    {0x2753, 0x2755},
+    {0x2757, 0x2757},
+    {0x2795, 0x2797},
+    {0x27b0, 0x27b0},
+    {0x27bf, 0x27bf},
+    {0x2b1b, 0x2b1c},
+    {0x2b50, 0x2b50},
+    {0x2b55, 0x2b55},
+    {0x2e80, 0x2e99},
+    {0x2e9b, 0x2ef3},
+    {0x2f00, 0x2fd5},
+    {0x2ff0, 0x2ffb},
+    {0x3000, 0x303e},
+    {0x3041, 0x3096},
+    {0x3099, 0x30ff},
+    {0x3105, 0x312f},
+    {0x3131, 0x318e},
+    {0x3190, 0x31ba},
+    {0x31c0, 0x31e3},
+    {0x31f0, 0x321e},
+    {0x3220, 0x3247},
+    {0x3250, 0x32fe},
+    {0x3300, 0x4dbf},
+    {0x4e00, 0xa48c},
+    {0xa490, 0xa4c6},
+    {0xa960, 0xa97c},
+    {0xac00, 0xd7a3},
+    {0xf900, 0xfaff},
+    {0xfe10, 0xfe19},
+    {0xfe30, 0xfe52},
+    {0xfe54, 0xfe66},
+    {0xfe68, 0xfe6b},
+    {0xff01, 0xff60},
+    {0xffe0, 0xffe6},
+    {0x16fe0, 0x16fe1},
+    {0x17000, 0x187f1},
+    {0x18800, 0x18af2},
+    {0x1b000, 0x1b11e},
+    {0x1b170, 0x1b2fb},
+    {0x1f004, 0x1f004},
+    {0x1f0cf, 0x1f0cf},
+    {0x1f18e, 0x1f18e},
+    {0x1f191, 0x1f19a},
+    {0x1f200, 0x1f202},
+    {0x1f210, 0x1f23b},
+    {0x1f240, 0x1f248},
+    {0x1f250, 0x1f251},
+    {0x1f260, 0x1f265},
+    {0x1f300, 0x1f320},
+    {0x1f32d, 0x1f335},
+    {0x1f337, 0x1f37c},
+    {0x1f37e, 0x1f393},
+    {0x1f3a0, 0x1f3ca},
+    {0x1f3cf, 0x1f3d3},
+    {0x1f3e0, 0x1f3f0},
+    {0x1f3f4, 0x1f3f4},
+    {0x1f3f8, 0x1f43e},
+    {0x1f440, 0x1f440},
+    {0x1f442, 0x1f4fc},
+    {0x1f4ff, 0x1f53d},
+    {0x1f54b, 0x1f54e},
+    {0x1f550, 0x1f567},
+    {0x1f57a, 0x1f57a},
+    {0x1f595, 0x1f596},
+    {0x1f5a4, 0x1f5a4},
+    {0x1f5fb, 0x1f64f},
+    {0x1f680, 0x1f6c5},
+    {0x1f6cc, 0x1f6cc},
+    {0x1f6d0, 0x1f6d2},
+    {0x1f6eb, 0x1f6ec},
+    {0x1f6f4, 0x1f6f9},
+    {0x1f910, 0x1f93e},
+    {0x1f940, 0x1f970},
+    {0x1f973, 0x1f976},
+    {0x1f97a, 0x1f97a},
+    {0x1f97c, 0x1f9a2},
+    {0x1f9b0, 0x1f9b9},
+    {0x1f9c0, 0x1f9c2},
+    {0x1f9d0, 0x1f9ff},
+    {0x20000, 0x2fffd},
+    {0x30000, 0x3fffd}
+};
+
+/* Sorted list of non-overlapping intervals of Emoji characters that don't
+ * have ambiguous or double width,
+ * based on http://unicode.org/emoji/charts/emoji-list.html */
+static struct interval emoji_width[] =
+{
+    {0x1f1e6, 0x1f1ff},
+    {0x1f321, 0x1f321},
+    {0x1f324, 0x1f32c},
+    {0x1f336, 0x1f336},
+    {0x1f37d, 0x1f37d},
+    {0x1f396, 0x1f397},
+    {0x1f399, 0x1f39b},
+    {0x1f39e, 0x1f39f},
+    {0x1f3cb, 0x1f3ce},
+    {0x1f3d4, 0x1f3df},
+    {0x1f3f3, 0x1f3f5},
+    {0x1f3f7, 0x1f3f7},
+    {0x1f43f, 0x1f43f},
+    {0x1f441, 0x1f441},
+    {0x1f4fd, 0x1f4fd},
+    {0x1f549, 0x1f54a},
+    {0x1f56f, 0x1f570},
+    {0x1f573, 0x1f579},
+    {0x1f587, 0x1f587},
+    {0x1f58a, 0x1f58d},
+    {0x1f590, 0x1f590},
+    {0x1f5a5, 0x1f5a5},
+    {0x1f5a8, 0x1f5a8},
+    {0x1f5b1, 0x1f5b2},
+    {0x1f5bc, 0x1f5bc},
+    {0x1f5c2, 0x1f5c4},
+    {0x1f5d1, 0x1f5d3},
+    {0x1f5dc, 0x1f5de},
+    {0x1f5e1, 0x1f5e1},
+    {0x1f5e3, 0x1f5e3},
+    {0x1f5e8, 0x1f5e8},
+    {0x1f5ef, 0x1f5ef},
+    {0x1f5f3, 0x1f5f3},
+    {0x1f5fa, 0x1f5fa},
+    {0x1f6cb, 0x1f6cf},
+    {0x1f6e0, 0x1f6e5},
+    {0x1f6e9, 0x1f6e9},
+    {0x1f6f0, 0x1f6f0},
+    {0x1f6f3, 0x1f6f3}
+};
+
 /*
  * For UTF-8 character "c" return 2 for a double-width character, 1 for others.
  * Returns 0 for an unprintable character.
@@ -307,166 +538,6 @@ static struct interval ambiguous[] =
     int
 utf_char2cells(int c)
 {
-    /* Sorted list of non-overlapping intervals of East Asian double width
-     * characters, generated with ../runtime/tools/unicode.vim. */
-    static struct interval doublewidth[] =
-    {
-        {0x1100, 0x115f},
-        {0x231a, 0x231b},
-        {0x2329, 0x232a},
-        {0x23e9, 0x23ec},
-        {0x23f0, 0x23f0},
-        {0x23f3, 0x23f3},
-        {0x25fd, 0x25fe},
-        {0x2614, 0x2615},
-        {0x2648, 0x2653},
-        {0x267f, 0x267f},
-        {0x2693, 0x2693},
-        {0x26a1, 0x26a1},
-        {0x26aa, 0x26ab},
-        {0x26bd, 0x26be},
-        {0x26c4, 0x26c5},
-        {0x26ce, 0x26ce},
-        {0x26d4, 0x26d4},
-        {0x26ea, 0x26ea},
-        {0x26f2, 0x26f3},
-        {0x26f5, 0x26f5},
-        {0x26fa, 0x26fa},
-        {0x26fd, 0x26fd},
-        {0x2705, 0x2705},
-        {0x270a, 0x270b},
-        {0x2728, 0x2728},
-        {0x274c, 0x274c},
-        {0x274e, 0x274e},
-        {0x2753, 0x2755},
-        {0x2757, 0x2757},
-        {0x2795, 0x2797},
-        {0x27b0, 0x27b0},
-        {0x27bf, 0x27bf},
-        {0x2b1b, 0x2b1c},
-        {0x2b50, 0x2b50},
-        {0x2b55, 0x2b55},
-        {0x2e80, 0x2e99},
-        {0x2e9b, 0x2ef3},
-        {0x2f00, 0x2fd5},
-        {0x2ff0, 0x2ffb},
-        {0x3000, 0x303e},
-        {0x3041, 0x3096},
-        {0x3099, 0x30ff},
-        {0x3105, 0x312f},
-        {0x3131, 0x318e},
-        {0x3190, 0x31ba},
-        {0x31c0, 0x31e3},
-        {0x31f0, 0x321e},
-        {0x3220, 0x3247},
-        {0x3250, 0x32fe},
-        {0x3300, 0x4dbf},
-        {0x4e00, 0xa48c},
-        {0xa490, 0xa4c6},
-        {0xa960, 0xa97c},
-        {0xac00, 0xd7a3},
-        {0xf900, 0xfaff},
-        {0xfe10, 0xfe19},
-        {0xfe30, 0xfe52},
-        {0xfe54, 0xfe66},
-        {0xfe68, 0xfe6b},
-        {0xff01, 0xff60},
-        {0xffe0, 0xffe6},
-        {0x16fe0, 0x16fe1},
-        {0x17000, 0x187f1},
-        {0x18800, 0x18af2},
-        {0x1b000, 0x1b11e},
-        {0x1b170, 0x1b2fb},
-        {0x1f004, 0x1f004},
-        {0x1f0cf, 0x1f0cf},
-        {0x1f18e, 0x1f18e},
-        {0x1f191, 0x1f19a},
-        {0x1f200, 0x1f202},
-        {0x1f210, 0x1f23b},
-        {0x1f240, 0x1f248},
-        {0x1f250, 0x1f251},
-        {0x1f260, 0x1f265},
-        {0x1f300, 0x1f320},
-        {0x1f32d, 0x1f335},
-        {0x1f337, 0x1f37c},
-        {0x1f37e, 0x1f393},
-        {0x1f3a0, 0x1f3ca},
-        {0x1f3cf, 0x1f3d3},
-        {0x1f3e0, 0x1f3f0},
-        {0x1f3f4, 0x1f3f4},
-        {0x1f3f8, 0x1f43e},
-        {0x1f440, 0x1f440},
-        {0x1f442, 0x1f4fc},
-        {0x1f4ff, 0x1f53d},
-        {0x1f54b, 0x1f54e},
-        {0x1f550, 0x1f567},
-        {0x1f57a, 0x1f57a},
-        {0x1f595, 0x1f596},
-        {0x1f5a4, 0x1f5a4},
-        {0x1f5fb, 0x1f64f},
-        {0x1f680, 0x1f6c5},
-        {0x1f6cc, 0x1f6cc},
-        {0x1f6d0, 0x1f6d2},
-        {0x1f6eb, 0x1f6ec},
-        {0x1f6f4, 0x1f6f9},
-        {0x1f910, 0x1f93e},
-        {0x1f940, 0x1f970},
-        {0x1f973, 0x1f976},
-        {0x1f97a, 0x1f97a},
-        {0x1f97c, 0x1f9a2},
-        {0x1f9b0, 0x1f9b9},
-        {0x1f9c0, 0x1f9c2},
-        {0x1f9d0, 0x1f9ff},
-        {0x20000, 0x2fffd},
-        {0x30000, 0x3fffd}
-    };
-
-    /* Sorted list of non-overlapping intervals of Emoji characters that don't
-     * have ambiguous or double width,
-     * based on http://unicode.org/emoji/charts/emoji-list.html */
-    static struct interval emoji_width[] =
-    {
-        {0x1f1e6, 0x1f1ff},
-        {0x1f321, 0x1f321},
-        {0x1f324, 0x1f32c},
-        {0x1f336, 0x1f336},
-        {0x1f37d, 0x1f37d},
-        {0x1f396, 0x1f397},
-        {0x1f399, 0x1f39b},
-        {0x1f39e, 0x1f39f},
-        {0x1f3cb, 0x1f3ce},
-        {0x1f3d4, 0x1f3df},
-        {0x1f3f3, 0x1f3f5},
-        {0x1f3f7, 0x1f3f7},
-        {0x1f43f, 0x1f43f},
-        {0x1f441, 0x1f441},
-        {0x1f4fd, 0x1f4fd},
-        {0x1f549, 0x1f54a},
-        {0x1f56f, 0x1f570},
-        {0x1f573, 0x1f579},
-        {0x1f587, 0x1f587},
-        {0x1f58a, 0x1f58d},
-        {0x1f590, 0x1f590},
-        {0x1f5a5, 0x1f5a5},
-        {0x1f5a8, 0x1f5a8},
-        {0x1f5b1, 0x1f5b2},
-        {0x1f5bc, 0x1f5bc},
-        {0x1f5c2, 0x1f5c4},
-        {0x1f5d1, 0x1f5d3},
-        {0x1f5dc, 0x1f5de},
-        {0x1f5e1, 0x1f5e1},
-        {0x1f5e3, 0x1f5e3},
-        {0x1f5e8, 0x1f5e8},
-        {0x1f5ef, 0x1f5ef},
-        {0x1f5f3, 0x1f5f3},
-        {0x1f5fa, 0x1f5fa},
-        {0x1f6cb, 0x1f6cf},
-        {0x1f6e0, 0x1f6e5},
-        {0x1f6e9, 0x1f6e9},
-        {0x1f6f0, 0x1f6f0},
-        {0x1f6f3, 0x1f6f3}
-    };
-
     if (c >= 0x100)
     {
 #ifdef USE_WCHAR_FUNCTIONS
@@ -502,38 +573,233 @@ utf_char2cells(int c)
 
 /*********************************************************************/
 
+/* Cache of utf_char2cells results for the BMP; WIDTH_UNKNOWN marks an
+ * entry not looked up yet. */
+#define WIDTH_UNKNOWN   0xFF
+static unsigned char bmp_widths[0x10000];
+static int bmp_widths_full;     /* Nonzero if all are looked up */
 
-static void usage(void)
+/*
+ * Reset the width cache.  Must be called whenever ambw changes.
+ */
+void init_widths(void)
 {
-    fprintf(stderr,
-        "Usage: breaktext [OPTION]... <Input File> [Output File]\n"
-        "Last Change: 2024-03-05 22:57:00 +0800 (libunibreak %d.%d)\n"
-        "\n"
-        "Available options:\n"
-        "  -L<locale>   Locale of the console (system locale by default)\n"
-        "  -l<lang>     Language of input (asssume no language by default)\n"
-        "  -w<width>    Width of output text (72 by default)\n"
-        "  -i           Keep space indentation\n"
-        "  -v           Be verbose\n"
-        "\n"
-        "If the output file is omitted, stdout will be used.\n"
-        "The input file cannot be omitted, but you may use `-' for stdin.\n"
-        "\n"
-        "The `native' wide character type (wchar_t) is used in I/O routines,\n"
-        "and the encoding used is platform-dependent.  On POSIX-compliant\n"
-        "systems, the environment variables LANG, LC_ALL, and LC_CTYPE\n"
-        "control the locale/encoding (unless overridden with the -L option),\n"
-        "and UTF-8 will probably be used by default on modern systems.  On\n"
-        "Windows, the encoding is dependent on whether stdin/stdout is used\n"
-        "for I/O: console I/O will be automatically converted to/from\n"
-        "wchar_t (which is UTF-16) according to the system locale setting\n"
-        "(overridable with -L), but files (excepting the stdin/stdout case)\n"
-        "will always be in just wchar_t (UTF-16).\n",
-        (unibreak_version >> 8), (unibreak_version & 0xFF)
-    );
+    memset(bmp_widths, WIDTH_UNKNOWN, sizeof bmp_widths);
+    bmp_widths_full = 0;
+}
+
+/*
+ * Look up the widths of all BMP characters in advance, so that threads
+ * finding widths only read the cache.
+ */
+static void fill_widths(void)
+{
+    unsigned int c;
+
+    if (bmp_widths_full)
+        return;
+    for (c = 0x80; c < 0x10000; ++c)
+    {
+        if (bmp_widths[c] == WIDTH_UNKNOWN)
+            bmp_widths[c] = (unsigned char)utf_char2cells((int)c);
+    }
+    bmp_widths_full = 1;
+}
+
+int char_width(unsigned int c)
+{
+    unsigned char w;
+
+    if (c < 0x80)
+        return 1;
+    if (c >= 0x10000)
+        return utf_char2cells((int)c);
+    w = bmp_widths[c];
+    if (w == WIDTH_UNKNOWN)
+        w = bmp_widths[c] = (unsigned char)utf_char2cells((int)c);
+    return w;
+}
+
+/*
+ * If the line at buffer[i] certainly fits in "width" without
+ * analysis, being printable ASCII no longer than the width and ending
+ * with '\n', return the position after it.  Otherwise return 0.
+ */
+static size_t short_line_end(const wchar_t *buffer, size_t i, size_t len,
+                             int width)
+{
+    size_t limit = len - i > (size_t)width ? i + width : len - 1;
+
+    for (; i <= limit; ++i)
+    {
+        if (buffer[i] == L'\n')
+            return i + 1;
+        if (buffer[i] < 0x20 || buffer[i] > 0x7E)
+            return 0;
+    }
+    return 0;
+}
+
+/* Find the end of the lines from "begin" that short_line_end accepts */
+static size_t skip_short_lines(const wchar_t *buffer, size_t begin,
+                               size_t len)
+{
+    size_t end;
+
+    while (begin < len &&
+            (end = short_line_end(buffer, begin, len, width)) != 0)
+        begin = end;
+    return begin;
+}
+
+/* Find the end of the paragraphs from "begin" that are not short lines */
+static size_t skip_long_lines(const wchar_t *buffer, size_t begin,
+                              size_t len)
+{
+    const wchar_t *lf;
+
+    while (begin < len && short_line_end(buffer, begin, len, width) == 0)
+    {
+        lf = wmemchr(buffer + begin, L'\n', len - begin);
+        begin = lf ? (size_t)(lf - buffer) + 1 : len;
+    }
+    return begin;
+}
+
+/*
+ * Fill widths[begin..len) with the display widths of the characters
+ * in buffer[begin..len), so that the layout loop only needs to read a
+ * byte per character.  Results for BMP characters are cached, as the table
+ * searches in utf_char2cells are too costly to repeat for text in
+ * CJK or other non-Latin scripts.
+ */
+static void set_widths_range(const wchar_t *buffer, size_t begin,
+                             size_t len, unsigned char *widths)
+{
+    size_t i;
+    unsigned int c;
+
+    for (i = begin; i < len; ++i)
+    {
+        c = (unsigned int)buffer[i];
+        widths[i] = c < 0x80 ? 1 : (unsigned char)char_width(c);
+    }
+}
+
+/* Find the widths; the short lines are skipped if short_lines is set */
+void set_widths(const wchar_t *buffer, size_t len, unsigned char *widths)
+{
+    size_t begin, end;
+
+    if (!short_lines)
+    {
+        set_widths_range(buffer, 0, len, widths);
+        return;
+    }
+    for (begin = skip_short_lines(buffer, 0, len); begin < len;
+            begin = skip_short_lines(buffer, end, len))
+    {
+        end = skip_long_lines(buffer, begin, len);
+        set_widths_range(buffer, begin, end, widths);
+    }
+}
+
+/* Unpacked breaks of find_breaks_range, except in batch threads */
+static char chunk_brks[MAXCHUNK];
+
+/*
+ * Find the breaking opportunities in buffer[begin..len) and store them
+ * packed in "brks".  As a line feed is always a mandatory break, the text is
+ * analysed a few paragraphs at a time, so that the unpacked result from
+ * libunibreak stays small in "chunk" (of MAXCHUNK bytes).
+ */
+static void find_breaks_range(const wchar_t *buffer, size_t begin,
+                              size_t len, const char *lang,
+                              unsigned char *brks, char *chunk)
+{
+    char *tmp_brks;
+    size_t end, i;
+    const wchar_t *lf;
+
+    for (; begin < len; begin = end)
+    {
+        /* Take as many whole paragraphs as possible */
+        end = begin + MAXCHUNK;
+        if (end >= len)
+        {
+            end = len;
+        }
+        else
+        {
+            while (end > begin && buffer[end - 1] != L'\n')
+                --end;
+            if (end == begin)
+            {   /* The paragraph is longer than the chunk */
+                lf = wmemchr(buffer + begin + MAXCHUNK, L'\n',
+                             len - begin - MAXCHUNK);
+                end = lf ? (size_t)(lf - buffer) + 1 : len;
+            }
+        }
+
+        if (end - begin <= MAXCHUNK)
+        {
+            tmp_brks = chunk;
+        }
+        else if ( (tmp_brks = malloc(end - begin)) == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+
+        if (sizeof(wchar_t) == 2)
+        {
+            set_linebreaks_utf16((utf16_t*)buffer + begin, end - begin,
+                                 lang, tmp_brks);
+        }
+        else
+        {
+            set_linebreaks_utf32((utf32_t*)buffer + begin, end - begin,
+                                 lang, tmp_brks);
+        }
+        for (i = begin; i < end; ++i)
+        {
+            brks[i / 4] |= (unsigned char)((tmp_brks[i - begin] & 3) <<
+                                           (i % 4 * 2));
+        }
+
+        if (tmp_brks != chunk)
+        {
+            free(tmp_brks);
+        }
+    }
+}
+
+/*
+ * Find the breaking opportunities.  If short_lines is set, the short
+ * lines (see short_line_end) are skipped, and left as mandatory breaks.
+ */
+void find_breaks(const wchar_t *buffer, size_t len, const char *lang,
+                 unsigned char *brks)
+{
+    size_t begin, end;
+
+    memset(brks, 0, BRKS_SIZE(len));
+    if (!short_lines)
+    {
+        find_breaks_range(buffer, 0, len, lang, brks, chunk_brks);
+        return;
+    }
+    for (begin = skip_short_lines(buffer, 0, len); begin < len;
+            begin = skip_short_lines(buffer, end, len))
+    {
+        end = skip_long_lines(buffer, begin, len);
+        find_breaks_range(buffer, begin, end, lang, brks, chunk_brks);
+    }
 }
 
-static void put_buffer(wchar_t *buffer, size_t begin, size_t end, FILE *fp_out)
+
+static void put_buffer(const wchar_t *buffer, size_t begin, size_t end,
+                       FILE *fp_out)
 {
     size_t i;
     for (i = begin; i < end; ++i)
@@ -551,31 +817,273 @@ static void put_indent(int indent, FILE *fp_out)
     }
 }
 
-void break_text(wchar_t *buffer, char *brks, size_t len, FILE *fp_out)
+static int file_put_line(struct line_sink *sink, const wchar_t *buffer,
+                         const struct line *line)
+{
+    FILE *fp_out = ((struct file_sink *)sink)->fp;
+
+    put_indent(line->indent, fp_out);
+    put_buffer(buffer, line->begin, line->end, fp_out);
+    if (line->hyphen)
+    {
+        putwc(L'-', fp_out);
+    }
+    putwc(L'\n', fp_out);
+    return 0;
+}
+
+/*
+ * Write buffer[begin..end) to a byte-oriented stream, converting it to
+ * multibyte characters.  Like putwc, characters that cannot be
+ * converted are dropped.
+ */
+static void put_mb_buffer(const wchar_t *buffer, size_t begin, size_t end,
+                          FILE *fp_out)
+{
+    char bytes[256 + MB_LEN_MAX];
+    mbstate_t state;
+    size_t len = 0, n, i;
+
+    memset(&state, 0, sizeof state);
+    for (i = begin; i < end; ++i)
+    {
+        if (buffer[i] < 0x80 && mbsinit(&state))
+        {   /* ASCII, as in decode_locale */
+            bytes[len++] = (char)buffer[i];
+            if (len >= 256)
+            {
+                fwrite(bytes, 1, len, fp_out);
+                len = 0;
+            }
+            continue;
+        }
+        n = wcrtomb(bytes + len, buffer[i], &state);
+        if (n == (size_t)-1)
+        {
+            memset(&state, 0, sizeof state);
+            continue;
+        }
+        len += n;
+        if (len >= 256)
+        {
+            fwrite(bytes, 1, len, fp_out);
+            len = 0;
+        }
+    }
+    fwrite(bytes, 1, len, fp_out);
+}
+
+static int mb_put_line(struct line_sink *sink, const wchar_t *buffer,
+                       const struct line *line)
+{
+    FILE *fp_out = ((struct file_sink *)sink)->fp;
+    int indent;
+
+    for (indent = line->indent; indent; --indent)
+    {
+        putc(' ', fp_out);
+    }
+    put_mb_buffer(buffer, line->begin, line->end, fp_out);
+    if (line->hyphen)
+    {
+        putc('-', fp_out);
+    }
+    putc('\n', fp_out);
+    return 0;
+}
+
+void init_file_sink(struct file_sink *sink, FILE *fp)
+{
+    sink->sink.put_line = fwide(fp, 0) < 0 ? mb_put_line : file_put_line;
+    sink->fp = fp;
+}
+
+/*
+ * A character is laid out again after a soft break only if it is after
+ * the breaking position, and once more if it is cut there; the "C++"
+ * rule lays out a character once more too.  Hyphenating a line looks at
+ * no more than HYPHEN_MAXWORD + 1 letters and a character on either
+ * side.  Debug builds check that no more work is done, so that no input
+ * can make the layout superlinear.
+ */
+#define MAXPASSES   4
+#define HYPHENWORK  (HYPHEN_MAXWORD + 3)
+#ifdef NDEBUG
+#define COUNT_WORK(it, n)
+#define ALLOW_WORK(it, n)
+#define CHECK_WORK(it, i)
+#else
+#define COUNT_WORK(it, n)   ((it)->work += (n))
+#define ALLOW_WORK(it, n)   ((it)->allowance += (n))
+#define CHECK_WORK(it, i)   \
+    assert((it)->work <= MAXPASSES * ((i) + 1 - (it)->begin) + \
+                         (it)->allowance)
+#endif
+
+/*
+ * Find where to hyphenate the word that crosses the right margin at
+ * buffer[i], which brings the line to column "col".  The hyphenation
+ * point must be after "from" and leave room for the hyphen.  Returns 0
+ * if there is no such point; otherwise returns the position, and sets
+ * "*tail_col" to the width of the characters from it to buffer[i].
+ */
+static size_t find_hyphen(struct line_iter *it, size_t from, size_t i,
+                          int col, int *tail_col)
+{
+    const wchar_t *buffer = it->buffer;
+    char points[HYPHEN_MAXWORD + 1];
+    size_t begin, end, pos;
+    int tail = 0;
+
+    if (!iswalpha(buffer[i]))
+        return 0;
+    /* Look no further than needed to know that the word is too long, or
+     * a long run of letters would be scanned at every line */
+    for (begin = i; begin > from && i - begin <= HYPHEN_MAXWORD &&
+                    iswalpha(buffer[begin - 1]); --begin)
+        ;
+    for (end = i + 1; end < it->len && end - begin <= HYPHEN_MAXWORD &&
+                      iswalpha(buffer[end]); ++end)
+        ;
+    COUNT_WORK(it, end - begin + 2);
+    ALLOW_WORK(it, HYPHENWORK);
+    if (end - begin > HYPHEN_MAXWORD)
+        return 0;
+
+    hyphenate(it->hyphen_trie, buffer + begin, end - begin, points);
+    for (pos = i; pos > begin; --pos)
+    {
+        tail += it->widths[pos];
+        if (points[pos - begin] && col - tail + 1 <= it->width)
+        {
+            *tail_col = tail;
+            return pos;
+        }
+    }
+    return 0;
+}
+
+void line_iter_init(struct line_iter *it, const wchar_t *buffer,
+                    unsigned char *brks, const unsigned char *widths,
+                    size_t begin, size_t len)
+{
+    it->buffer = buffer;
+    it->brks = brks;
+    it->widths = widths;
+    it->begin = begin;
+    it->len = len;
+    it->width = width;
+    it->keep_indent = keep_indent;
+    it->short_lines = short_lines;
+    it->hyphen_trie = hyphen_trie;
+    it->pos = begin;
+    it->last_break_pos = begin;
+    it->last_breakable_pos = begin;
+    it->col = 0;
+    it->indent = 0;
+    it->line_indent = 0;
+    it->is_at_beginning = 1;
+    it->tail_col = 0;
+    it->tail_unsure = 0;
+    it->resume = 0;
+    it->hard_start = 1;
+    it->work = 0;
+    it->allowance = 0;
+}
+
+/*
+ * Start "it" where a line was broken inside a paragraph with the
+ * indentation "para_indent".  The state after a line is broken depends
+ * on nothing else, which break_text_parallel relies on.
+ */
+static void line_iter_start_inside(struct line_iter *it, int para_indent)
+{
+    it->indent = para_indent;
+    it->is_at_beginning = 0;
+    it->hard_start = 0;
+    if (it->keep_indent)
+    {
+        it->line_indent = para_indent;
+        it->col = para_indent;
+    }
+}
+
+/*
+ * Find the next line.  The options are only tested when a line is
+ * broken or a '/' is met, so there is no need to specialize the loop for
+ * them.  The state is kept in locals, and saved in "it" when a line is
+ * returned.
+ */
+int line_iter_next(struct line_iter *it, struct line *line)
 {
+    const wchar_t *buffer = it->buffer;
+    unsigned char *brks = it->brks;
+    const unsigned char *widths = it->widths;
+    const size_t len = it->len;
+    const int width = it->width;
+    const int long_line = width > 40;
     wchar_t ch;
     int w;
-    size_t i;
-    size_t last_break_pos = 0;
-    size_t last_breakable_pos = 0;
-    int col = 0;
-    int indent = 0;
-    int is_at_beginning = 1;
+    int brk;
+    size_t i = it->pos;
+    size_t end;
+    size_t hyphen_pos;
+    size_t last_break_pos = it->last_break_pos;
+    size_t last_breakable_pos = it->last_breakable_pos;
+    int col = it->col;
+    int indent = it->indent;
+    int line_indent = it->line_indent;
+    int is_at_beginning = it->is_at_beginning;
+    /* Width of the characters since last_breakable_pos, which will be
+     * carried over to the next line if the margin is crossed */
+    int tail_col = it->tail_col;
+    /* Number of characters since last_breakable_pos that may be treated
+     * differently at a new column (so tail_col cannot be trusted) */
+    int tail_unsure = it->tail_unsure;
+
+    if (it->resume)
+    {   /* Finish the character after which the last line was broken */
+        it->resume = 0;
+        brk = GET_BRK(brks, i);
+        w = widths[i];
+        goto check_breakable;
+    }
+
+    if (it->hard_start && it->short_lines && i < len &&
+            (end = short_line_end(buffer, i, len, width)) != 0)
+    {   /* A line that fits as it is */
+        line->begin = i;
+        line->end = end - 1;
+        line->indent = 0;
+        line->hyphen = 0;
+        line->hard = 1;
+        it->pos = it->last_break_pos = it->last_breakable_pos = end;
+        return 1;
+    }
 
-    for (i = 0; i < len; ++i)
+    for (; i < len; ++i)
     {
-        if (brks[i] == LINEBREAK_MUSTBREAK)
+        COUNT_WORK(it, 1);
+        brk = GET_BRK(brks, i);
+        if (brk == LINEBREAK_MUSTBREAK)
         {
-            /* Display undisplayed characters in the buffer */
-            put_buffer(buffer, last_break_pos, i, fp_out);
+            CHECK_WORK(it, i);
             /* The character causing the explicit break is replaced with \n */
-            putwc(L'\n', fp_out);
+            line->begin = last_break_pos;
+            line->end = i;
+            line->indent = line_indent;
+            line->hyphen = 0;
+            line->hard = 1;
             /* Update positions */
-            col = 0;
-            indent = 0;
-            is_at_beginning = 1;
-            last_break_pos = last_breakable_pos = i + 1;
-            continue;
+            it->pos = it->last_break_pos = it->last_breakable_pos = i + 1;
+            it->col = 0;
+            it->indent = 0;
+            it->line_indent = 0;
+            it->is_at_beginning = 1;
+            it->tail_col = 0;
+            it->tail_unsure = 0;
+            it->hard_start = 1;
+            return 1;
         }
 
         /* Special processing for space-based indentation */
@@ -598,101 +1106,2658 @@ void break_text(wchar_t *buffer, char *brks, size_t len, FILE *fp_out)
         }
 
         /* Special processing for "C++": no break. */
-        if (buffer[i] == L'C' && brks[i] == LINEBREAK_ALLOWBREAK &&
+        if (buffer[i] == L'C' && brk == LINEBREAK_ALLOWBREAK &&
                 (i < len - 2 &&
                  buffer[i + 1] == L'+' && buffer[i + 2] == L'+') &&
                 ((i < len - 3 && buffer[i + 3] == L' ') ||
-                 brks[i + 2] < LINEBREAK_NOBREAK) &&
-                (i == 0 || brks[i - 1] < LINEBREAK_NOBREAK))
+                 GET_BRK(brks, i + 2) < LINEBREAK_NOBREAK) &&
+                (i == 0 || GET_BRK(brks, i - 1) < LINEBREAK_NOBREAK))
         {
-            brks[i] = brks[i + 1] = LINEBREAK_NOBREAK;
+            SET_BRK(brks, i, LINEBREAK_NOBREAK);
+            SET_BRK(brks, i + 1, LINEBREAK_NOBREAK);
             --i;
             continue;
         }
 
         ch = buffer[i];
-        w = utf_char2cells(ch);
+        w = widths[i];
 
         /* Right-margin spaces do not count */
-        if (!(ch == L' ' && col == width))
+        if (ch == L' ' && col == width)
         {
-            col += w;
+            /* But it will count on a new line */
+            ++tail_unsure;
         }
-
-        /* An breakable position encountered before the right margin */
-        if (col <= width)
-        {
-            if (brks[i] == LINEBREAK_ALLOWBREAK)
-            {
-                if (buffer[i] == L'/' && col > 8)
-                {   /* Ignore the breaking chance if there is a chance
-                     * immediately before: no break inside "c/o", and no
-                     * break after "http://" in a long line. */
-                    if (last_breakable_pos > i - 2 ||
-                            (width > 40 && last_breakable_pos > i - 7 &&
-                             buffer[i - 1] == L'/'))
-                    {
-                        continue;
-                    }
-                    /* Special rule to treat Unix paths more nicely */
-                    if (i < len - 1 && buffer[i + 1] != L' ' &&
-                                       buffer[i - 1] == L' ')
-                    {
-                        last_breakable_pos = i;
-                        continue;
-                    }
-                }
-                last_breakable_pos = i + 1;
-            }
+        else
+        {
+            col += w;
+            tail_col += w;
         }
 
         /* Right margin crossed */
-        else
+        if (col > width)
         {
-            /* No breakable character since the last break */
-            if (last_breakable_pos == last_break_pos)
+            /* Hyphenate the word crossing the margin if possible */
+            hyphen_pos = 0;
+            if (it->hyphen_trie)
             {
-                last_breakable_pos = i;
+                hyphen_pos = find_hyphen(it, last_breakable_pos, i, col,
+                                         &tail_col);
             }
-            else
+            if (hyphen_pos)
             {
-                i = last_breakable_pos;
+                last_breakable_pos = hyphen_pos;
+                tail_unsure = 0;
+            }
+            /* No breakable character since the last break */
+            else if (last_breakable_pos == last_break_pos)
+            {
+                last_breakable_pos = i;
+                tail_col = w;
+                tail_unsure = 0;
             }
 
-            /* Display undisplayed characters in the buffer */
-            put_buffer(buffer, last_break_pos, last_breakable_pos, fp_out);
-
-            /* Output a new line and reset status */
-            putwc(L'\n', fp_out);
-            if (keep_indent)
+            CHECK_WORK(it, i);
+            /* Return the line and reset status */
+            line->begin = last_break_pos;
+            line->end = last_breakable_pos;
+            line->indent = line_indent;
+            line->hyphen = hyphen_pos != 0;
+            line->hard = 0;
+            if (it->keep_indent)
             {
-                put_indent(indent, fp_out);
+                line_indent = indent;
                 col = indent;
             }
             else
             {
+                line_indent = 0;
                 col = 0;
             }
             last_break_pos = last_breakable_pos;
 
-            /* To be ++'d */
-            --i;
+            /* Start the new line with the characters after the break.
+             * They need to be laid out again only if the new column
+             * could change how they are treated. */
+            if (tail_unsure || col + tail_col > width)
+            {
+                i = last_breakable_pos;
+                tail_col = 0;
+                tail_unsure = 0;
+            }
+            else
+            {
+                col += tail_col;
+                it->resume = 1;
+            }
+            goto save;
+        }
+
+check_breakable:
+        /* An breakable position encountered before the right margin */
+        if (brk == LINEBREAK_ALLOWBREAK)
+        {
+            if (buffer[i] == L'/' && col > 8)
+            {   /* Ignore the breaking chance if there is a chance
+                 * immediately before: no break inside "c/o", and no
+                 * break after "http://" in a long line. */
+                if (last_breakable_pos > i - 2 ||
+                        (long_line && last_breakable_pos > i - 7 &&
+                         buffer[i - 1] == L'/'))
+                {
+                    ++tail_unsure;
+                    continue;
+                }
+                /* Special rule to treat Unix paths more nicely */
+                if (i < len - 1 && buffer[i + 1] != L' ' &&
+                                   buffer[i - 1] == L' ')
+                {
+                    last_breakable_pos = i;
+                    tail_col = w;
+                    tail_unsure = 1;
+                    continue;
+                }
+            }
+            last_breakable_pos = i + 1;
+            tail_col = 0;
+            tail_unsure = 0;
         }
     }
+    CHECK_WORK(it, i);
+    it->pos = i;
+    return 0;
+
+save:
+    it->pos = i;
+    it->last_break_pos = last_break_pos;
+    it->last_breakable_pos = last_breakable_pos;
+    it->col = col;
+    it->indent = indent;
+    it->line_indent = line_indent;
+    it->is_at_beginning = is_at_beginning;
+    it->tail_col = tail_col;
+    it->tail_unsure = tail_unsure;
+    it->hard_start = 0;
+    return 1;
 }
 
-int main(int argc, char *argv[])
+/*
+ * Break the text and pass the lines to the sink.  If "para_indent" is
+ * negative, "begin" is the start of a paragraph; otherwise, it is where
+ * a line was broken inside a paragraph with that indentation.
+ */
+static int break_lines(const wchar_t *buffer, unsigned char *brks,
+                       const unsigned char *widths, size_t begin, size_t len,
+                       int para_indent, struct line_sink *sink)
 {
-    FILE *fp_in;
-    FILE *fp_out;
-    size_t c;
-    const char opts[] = "L:l:w:iv";
-    char opt;
-    wint_t wch;
-    const char *loc;
-    pctimer_t t1, t2, t3, t4;
+    struct line_iter it;
+    struct line line;
 
-    if (argc == 1)
+    line_iter_init(&it, buffer, brks, widths, begin, len);
+    if (para_indent >= 0)
+        line_iter_start_inside(&it, para_indent);
+    while (line_iter_next(&it, &line))
+    {
+        if (sink->put_line(sink, buffer, &line))
+            return 1;
+    }
+    return 0;
+}
+
+int break_text(const wchar_t *buffer, unsigned char *brks,
+               const unsigned char *widths, size_t begin, size_t len,
+               struct line_sink *sink)
+{
+    return break_lines(buffer, brks, widths, begin, len, -1, sink);
+}
+
+unsigned long chunks_accepted;
+unsigned long chunks_recomputed;
+
+/*
+ * Characters looked at by break_text_parallel before the layout, which
+ * debug builds check to be no more than MAXPASSES times the text
+ */
+#ifdef NDEBUG
+#define COUNT_SCAN(n)
+#else
+static size_t scan_work;
+#define COUNT_SCAN(n)       (scan_work += (n))
+#endif
+
+/*
+ * Apply the "C++" rule of break_lines to buffer[begin..len) in advance,
+ * in the same order, so that the threads of break_text_parallel never
+ * change brks.  As in break_lines, a "C" at "begin" still depends on the
+ * break before it, unless it starts the text.
+ */
+static void apply_cpp_rule(const wchar_t *buffer, unsigned char *brks,
+                           size_t begin, size_t len)
+{
+    const wchar_t *p = buffer + begin;
+    size_t i;
+
+    COUNT_SCAN(len - begin);
+    while (len - (p - buffer) > 2 &&
+           (p = wmemchr(p, L'C', len - (p - buffer) - 2)) != NULL)
+    {
+        i = p++ - buffer;
+        if (GET_BRK(brks, i) == LINEBREAK_ALLOWBREAK &&
+                buffer[i + 1] == L'+' && buffer[i + 2] == L'+' &&
+                ((i < len - 3 && buffer[i + 3] == L' ') ||
+                 GET_BRK(brks, i + 2) < LINEBREAK_NOBREAK) &&
+                (i == 0 || GET_BRK(brks, i - 1) < LINEBREAK_NOBREAK))
+        {
+            SET_BRK(brks, i, LINEBREAK_NOBREAK);
+            SET_BRK(brks, i + 1, LINEBREAK_NOBREAK);
+        }
+    }
+}
+
+/* Sink that collects the lines starting before "stop" */
+struct line_list
+{
+    struct line_sink sink;
+    struct line *lines;
+    size_t count;
+    size_t capacity;
+    size_t stop;
+    struct line next;           /* First line starting at "stop" or later */
+    int stopped;
+    int error;
+};
+
+static int list_put_line(struct line_sink *sink, const wchar_t *buffer,
+                         const struct line *line)
+{
+    struct line_list *list = (struct line_list *)sink;
+    struct line *lines;
+    size_t capacity;
+
+    (void)buffer;
+    if (line->begin >= list->stop)
+    {
+        list->next = *line;
+        list->stopped = 1;
+        return 1;
+    }
+    if (list->count == list->capacity)
+    {
+        capacity = list->capacity ? list->capacity * 2 : 1024;
+        lines = realloc(list->lines, capacity * sizeof(struct line));
+        if (lines == NULL)
+        {
+            list->error = 1;
+            return 1;
+        }
+        list->lines = lines;
+        list->capacity = capacity;
+    }
+    list->lines[list->count++] = *line;
+    return 0;
+}
+
+/* A part of the text laid out by a thread, from a guessed line start */
+struct wrap_job
+{
+    const wchar_t *buffer;
+    unsigned char *brks;
+    const unsigned char *widths;
+    size_t begin;
+    size_t len;
+    int para_indent;
+    struct line_list list;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+    /* For the trace: when the job ran, and when the main thread started
+     * waiting for it and got it */
+    double t_begin;
+    double t_end;
+    double t_wait;
+    double t_joined;
+    int accepted;
+};
+
+static void *run_wrap_job(void *arg)
+{
+    struct wrap_job *job = arg;
+
+    job->t_begin = pctimer();
+    break_lines(job->buffer, job->brks, job->widths, job->begin, job->len,
+                job->para_indent, &job->list.sink);
+    job->t_end = pctimer();
+    return NULL;
+}
+
+/*
+ * Guess where a line may start at or after "pos", and the indentation of
+ * the paragraph there (-1 at a paragraph start).  The paragraph start is
+ * looked for only nearby; a wrong guess only costs recomputation.
+ */
+static size_t guess_line_start(const wchar_t *buffer,
+                               const unsigned char *brks, size_t begin,
+                               size_t pos, size_t limit, int *para_indent)
+{
+    size_t i, start;
+    int indent = 0;
+
+    for (i = pos; i < limit; ++i)
+    {
+        COUNT_SCAN(1);
+        if (GET_BRK(brks, i - 1) <= LINEBREAK_ALLOWBREAK)
+        {
+            pos = i;
+            break;
+        }
+    }
+    if (GET_BRK(brks, pos - 1) == LINEBREAK_MUSTBREAK)
+    {
+        *para_indent = -1;
+        return pos;
+    }
+
+    for (start = pos; start > begin && pos - start < 4096; --start)
+    {
+        COUNT_SCAN(1);
+        if (GET_BRK(brks, start - 1) == LINEBREAK_MUSTBREAK)
+            break;
+    }
+    if (start == begin || GET_BRK(brks, start - 1) == LINEBREAK_MUSTBREAK)
+    {
+        for (i = start; i < pos && buffer[i] == L' '; ++i)
+        {
+            COUNT_SCAN(1);
+            if (++indent >= width / 2)
+            {
+                indent = 0;
+                break;
+            }
+        }
+    }
+    *para_indent = indent;
+    return pos;
+}
+
+/* Sink that lays out the lines again, until they meet those of a job */
+struct resync_sink
+{
+    struct line_sink sink;
+    struct line_sink *out;
+    const struct line_list *list;   /* The lines to meet, or NULL */
+    size_t pos;                 /* Index in list of the line met */
+    size_t stop;
+    struct line next;
+    int synced;
+    int stopped;
+    int result;                 /* Nonzero if "out" stopped */
+};
+
+static int resync_put_line(struct line_sink *sink, const wchar_t *buffer,
+                           const struct line *line)
+{
+    struct resync_sink *rs = (struct resync_sink *)sink;
+    const struct line_list *list = rs->list;
+
+    if (list)
+    {
+        while (rs->pos < list->count && list->lines[rs->pos].begin <
+                                        line->begin)
+            ++rs->pos;
+        if (rs->pos < list->count &&
+                list->lines[rs->pos].begin == line->begin &&
+                list->lines[rs->pos].indent == line->indent)
+        {
+            rs->synced = 1;
+            return 1;
+        }
+    }
+    if (line->begin >= rs->stop)
+    {
+        rs->next = *line;
+        rs->stopped = 1;
+        return 1;
+    }
+    if (rs->out->put_line(rs->out, buffer, line))
+    {
+        rs->result = 1;
+        return 1;
+    }
+    return 0;
+}
+
+/* Index of the line starting at line->begin in "list", or list->count */
+static size_t find_line(const struct line_list *list,
+                        const struct line *line)
+{
+    size_t bot = 0, top = list->count, mid;
+
+    while (bot < top)
+    {
+        mid = (bot + top) / 2;
+        if (list->lines[mid].begin < line->begin)
+            bot = mid + 1;
+        else
+            top = mid;
+    }
+    if (bot < list->count && (list->lines[bot].begin != line->begin ||
+                              list->lines[bot].indent != line->indent))
+        bot = list->count;
+    return bot;
+}
+
+static int put_lines(const wchar_t *buffer, const struct line_list *list,
+                     size_t pos, struct line_sink *sink)
+{
+    for (; pos < list->count; ++pos)
+    {
+        if (sink->put_line(sink, buffer, &list->lines[pos]))
+            return 1;
+    }
+    return 0;
+}
+
+#ifndef _WIN32
+/*
+ * Write the spans of the jobs run by break_text_parallel to the trace:
+ * the layout of each part on its thread, and the waiting for it and the
+ * output of its lines (with the layout again of those before the lines
+ * met) on the main thread.  Parts from "count" on were not used, and the
+ * output of the last one used ended at "t_end".
+ */
+static void trace_jobs(const struct wrap_job *jobs, int threads,
+                       int started, int count, double t_end)
+{
+    char name[32];
+    size_t end;
+    int k;
+
+    for (k = 0; k < threads; ++k)
+    {
+        if (k > 0 && k >= started)
+            continue;
+        if (k > 0)
+        {
+            sprintf(name, "Worker %d", k);
+            trace_thread_name(k, name);
+        }
+        end = jobs[k].list.stopped ? jobs[k].list.next.begin : jobs[k].len;
+        trace_span("Layout", k, jobs[k].t_begin, jobs[k].t_end,
+                   "\"part\": %d, \"chars\": %lu, \"lines\": %lu",
+                   k, (unsigned long)(end - jobs[k].begin),
+                   (unsigned long)jobs[k].list.count);
+    }
+    for (k = 0; k < count; ++k)
+    {
+        if (k > 0)
+        {
+            trace_span("Waiting for part", 0, jobs[k].t_wait,
+                       jobs[k].t_joined, "\"part\": %d", k);
+        }
+        trace_span("Stitching and output", 0, jobs[k].t_joined,
+                   k + 1 < count ? jobs[k + 1].t_wait : t_end,
+                   "\"part\": %d, \"accepted\": %d, \"wait_us\": %.0f",
+                   k, jobs[k].accepted,
+                   (jobs[k].t_joined - jobs[k].t_wait) * 1e6);
+    }
+}
+#endif
+
+/*
+ * Like break_text, but lay out the text in "threads" parts at the same
+ * time.  Each thread starts from a guessed line start.  The part of a
+ * thread is accepted from the first line that starts where a line of the
+ * exact layout of the text before does (so that the rest cannot
+ * differ); until then, the text is laid out again.  The output is the
+ * same as that of break_text.
+ */
+int break_text_parallel(const wchar_t *buffer, unsigned char *brks,
+                        const unsigned char *widths, size_t begin,
+                        size_t len, struct line_sink *sink, int threads)
+{
+#ifdef _WIN32
+    (void)threads;
+    return break_text(buffer, brks, widths, begin, len, sink);
+#else
+    struct wrap_job *jobs;
+    struct resync_sink rs;
+    struct line next;
+    size_t part, pos;
+    double t_end;
+    int started;
+    int k, n;
+    int result = 0;
+
+    if ((len - begin) / MINPARALLEL < (size_t)threads)
+        threads = (int)((len - begin) / MINPARALLEL);
+    if (threads < 2 || (jobs = calloc(threads, sizeof *jobs)) == NULL)
+        return break_text(buffer, brks, widths, begin, len, sink);
+    memset(&next, 0, sizeof next);
+
+#ifndef NDEBUG
+    scan_work = 0;
+#endif
+    apply_cpp_rule(buffer, brks, begin, len);
+
+    part = (len - begin) / threads;
+    jobs[0].begin = begin;
+    jobs[0].para_indent = -1;
+    for (k = 1; k < threads; ++k)
+    {
+        jobs[k].begin = guess_line_start(buffer, brks, begin,
+                                         begin + part * k,
+                                         begin + part * k + part / 2,
+                                         &jobs[k].para_indent);
+    }
+#ifndef NDEBUG
+    assert(scan_work <= MAXPASSES * (len - begin));
+#endif
+    for (k = 0; k < threads; ++k)
+    {
+        jobs[k].buffer = buffer;
+        jobs[k].brks = brks;
+        jobs[k].widths = widths;
+        jobs[k].len = len;
+        jobs[k].list.sink.put_line = list_put_line;
+        jobs[k].list.stop = k + 1 < threads ? jobs[k + 1].begin : len;
+    }
+    for (started = 1; started < threads; ++started)
+    {
+        if (pthread_create(&jobs[started].thread, NULL, run_wrap_job,
+                           &jobs[started]) != 0)
+            break;
+    }
+
+    /* The first part is exact, and laid out here */
+    run_wrap_job(&jobs[0]);
+    jobs[0].t_wait = jobs[0].t_joined = jobs[0].t_end;
+    jobs[0].accepted = 1;
+    if (jobs[0].list.error)
+    {
+        k = 0;
+        result = -1;
+        goto done;
+    }
+    pos = 0;
+    for (k = 0; k < threads; ++k)
+    {
+        if (k > 0)
+        {
+            jobs[k].t_wait = pctimer();
+            if (k < started)
+                pthread_join(jobs[k].thread, NULL);
+            jobs[k].t_joined = pctimer();
+        }
+        if (result)
+            continue;
+
+        if (k > 0)
+        {
+            /* Find where the exact layout meets the lines of the job */
+            if (k >= started || jobs[k].list.error)
+                pos = jobs[k].list.count = 0;
+            else
+                pos = find_line(&jobs[k].list, &next);
+            if (pos == jobs[k].list.count)
+            {
+                memset(&rs, 0, sizeof rs);
+                rs.sink.put_line = resync_put_line;
+                rs.out = sink;
+                rs.list = jobs[k].list.count ? &jobs[k].list : NULL;
+                rs.stop = jobs[k].list.stop;
+                n = GET_BRK(brks, next.begin - 1) == LINEBREAK_MUSTBREAK ?
+                    -1 : next.indent;
+                break_lines(buffer, brks, widths, next.begin, len, n,
+                            &rs.sink);
+                if (rs.result)
+                {
+                    result = 1;
+                    continue;
+                }
+                if (!rs.synced)
+                {   /* Laid out to the end of the part, or of the text */
+                    ++chunks_recomputed;
+                    if (!rs.stopped)
+                        break;
+                    next = rs.next;
+                    continue;
+                }
+                pos = rs.pos;
+            }
+            ++chunks_accepted;
+            jobs[k].accepted = 1;
+        }
+
+        if (put_lines(buffer, &jobs[k].list, pos, sink))
+        {
+            result = 1;
+            continue;
+        }
+        if (!jobs[k].list.stopped)
+            break;
+        next = jobs[k].list.next;
+    }
+
+done:
+    t_end = pctimer();
+    n = k < threads ? k + 1 : threads;
+    /* Wait for the threads not joined after an early end */
+    for (++k; k < started; ++k)
+        pthread_join(jobs[k].thread, NULL);
+    if (trace_enabled() && result >= 0)
+        trace_jobs(jobs, threads, started, n, t_end);
+    for (k = 0; k < threads; ++k)
+        free(jobs[k].list.lines);
+    free(jobs);
+    if (result < 0)     /* Out of memory */
+        return break_text(buffer, brks, widths, begin, len, sink);
+    return result;
+#endif
+}
+
+/* Strings first..last-1 of a batch, broken by one thread */
+struct batch_part
+{
+    const wchar_t *const *strings;
+    const size_t *lengths;
+    size_t first;
+    size_t last;
+    const char *lang;
+    wchar_t *arena;             /* The strings, each followed by '\n' */
+    unsigned char *brks;
+    unsigned char *widths;
+    size_t arena_capacity;
+    struct batch_lines *lines;  /* Where the lines go */
+    struct batch_lines own_lines;
+    int error;
+#ifndef _WIN32
+    pthread_t thread;
+#endif
+    char chunk[MAXCHUNK];       /* For find_breaks_range */
+};
+
+void text_batch_init(struct text_batch *batch)
+{
+    memset(batch, 0, sizeof *batch);
+}
+
+static void free_batch_lines(struct batch_lines *lines)
+{
+    free(lines->first);
+    free(lines->begin);
+    free(lines->end);
+    free(lines->indent);
+    free(lines->hyphen);
+}
+
+void text_batch_free(struct text_batch *batch)
+{
+    int k;
+
+    for (k = 0; k < batch->part_count; ++k)
+    {
+        free(batch->parts[k].arena);
+        free(batch->parts[k].brks);
+        free(batch->parts[k].widths);
+        free_batch_lines(&batch->parts[k].own_lines);
+    }
+    free(batch->parts);
+    free_batch_lines(&batch->lines);
+    memset(batch, 0, sizeof *batch);
+}
+
+/* Make room for "count" lines and the first lines of "strings" strings */
+static int grow_batch_lines(struct batch_lines *lines, size_t count,
+                            size_t strings)
+{
+    size_t capacity;
+    void *ptr;
+
+    if (strings + 1 > lines->string_capacity)
+    {
+        capacity = lines->string_capacity ? lines->string_capacity : 1024;
+        while (capacity < strings + 1)
+            capacity *= 2;
+        if ( (ptr = realloc(lines->first, capacity * sizeof(size_t))) == NULL)
+            return -1;
+        lines->first = ptr;
+        lines->string_capacity = capacity;
+    }
+    if (count > lines->capacity)
+    {
+        capacity = lines->capacity ? lines->capacity : 1024;
+        while (capacity < count)
+            capacity *= 2;
+        /* A failure leaves the arrays grown so far still valid */
+        if ( (ptr = realloc(lines->begin, capacity * sizeof(size_t))) == NULL)
+            return -1;
+        lines->begin = ptr;
+        if ( (ptr = realloc(lines->end, capacity * sizeof(size_t))) == NULL)
+            return -1;
+        lines->end = ptr;
+        if ( (ptr = realloc(lines->indent, capacity * sizeof(int))) == NULL)
+            return -1;
+        lines->indent = ptr;
+        if ( (ptr = realloc(lines->hyphen, capacity)) == NULL)
+            return -1;
+        lines->hyphen = ptr;
+        lines->capacity = capacity;
+    }
+    return 0;
+}
+
+static int grow_arena(struct batch_part *part, size_t len)
+{
+    void *ptr;
+
+    if (len <= part->arena_capacity)
+        return 0;
+    if ( (ptr = realloc(part->arena, len * sizeof(wchar_t))) == NULL)
+        return -1;
+    part->arena = ptr;
+    if ( (ptr = realloc(part->brks, BRKS_SIZE(len))) == NULL)
+        return -1;
+    part->brks = ptr;
+    if ( (ptr = realloc(part->widths, len)) == NULL)
+        return -1;
+    part->widths = ptr;
+    part->arena_capacity = len;
+    return 0;
+}
+
+/*
+ * Copy the strings of "part" into its arena, analyse them there at
+ * once, and lay them out as the paragraphs of one text.
+ */
+static void *run_batch_part(void *arg)
+{
+    struct batch_part *part = arg;
+    struct batch_lines *lines = part->lines;
+    const size_t *lengths = part->lengths + part->first;
+    const size_t count = part->last - part->first;
+    struct line_iter it;
+    struct line line;
+    size_t len, base, begin, end, k;
+
+    for (len = 0, k = 0; k < count; ++k)
+        len += lengths[k] + 1;
+    if (grow_arena(part, len) < 0 || grow_batch_lines(lines, 0, count) < 0)
+    {
+        part->error = 1;
+        return NULL;
+    }
+    lines->count = 0;
+    lines->first[0] = 0;
+    if (len == 0)
+        return NULL;
+    for (len = 0, k = 0; k < count; ++k)
+    {
+        wmemcpy(part->arena + len, part->strings[part->first + k],
+                lengths[k]);
+        len += lengths[k];
+        part->arena[len++] = L'\n';
+    }
+
+    memset(part->brks, 0, BRKS_SIZE(len));
+    for (begin = short_lines ? skip_short_lines(part->arena, 0, len) : 0;
+            begin < len;
+            begin = skip_short_lines(part->arena, end, len))
+    {
+        end = short_lines ? skip_long_lines(part->arena, begin, len) : len;
+        find_breaks_range(part->arena, begin, end, part->lang, part->brks,
+                          part->chunk);
+        set_widths_range(part->arena, begin, end, part->widths);
+    }
+
+    base = 0;
+    k = 0;
+    line_iter_init(&it, part->arena, part->brks, part->widths, 0, len);
+    while (line_iter_next(&it, &line))
+    {
+        if (lines->count == lines->capacity &&
+                grow_batch_lines(lines, lines->count + 1, count) < 0)
+        {
+            part->error = 1;
+            return NULL;
+        }
+        lines->begin[lines->count] = line.begin - base;
+        lines->end[lines->count] = line.end - base;
+        lines->indent[lines->count] = line.indent;
+        lines->hyphen[lines->count] = (unsigned char)line.hyphen;
+        ++lines->count;
+        /* The '\n' after the string, and not a mandatory break in it */
+        if (line.hard && line.end == base + lengths[k])
+        {
+            base = line.end + 1;
+            lines->first[++k] = lines->count;
+        }
+    }
+    return NULL;
+}
+
+int break_batch(struct text_batch *batch, const wchar_t *const *strings,
+                const size_t *lengths, size_t count, const char *lang,
+                int threads)
+{
+    struct batch_lines *lines = &batch->lines;
+    struct batch_lines *part_lines;
+    struct batch_part *parts;
+    size_t total, share, chars, i, k;
+    int n, started;
+
+    for (total = 0, k = 0; k < count; ++k)
+        total += lengths[k] + 1;
+#ifdef _WIN32
+    threads = 1;
+#endif
+    if (total / MINBATCH < (size_t)threads)
+        threads = (int)(total / MINBATCH);
+    if (threads < 1)
+        threads = 1;
+    if (threads > batch->part_count)
+    {
+        parts = realloc(batch->parts, threads * sizeof *parts);
+        if (parts == NULL)
+            return -1;
+        memset(parts + batch->part_count, 0,
+               (threads - batch->part_count) * sizeof *parts);
+        batch->parts = parts;
+        batch->part_count = threads;
+    }
+    parts = batch->parts;
+
+    /* Give the parts about the same numbers of characters */
+    share = total / threads;
+    for (k = 0, n = 0; n < threads; ++n)
+    {
+        parts[n].strings = strings;
+        parts[n].lengths = lengths;
+        parts[n].lang = lang;
+        parts[n].lines = n == 0 ? lines : &parts[n].own_lines;
+        parts[n].error = 0;
+        parts[n].first = k;
+        for (chars = 0; k < count && (n == threads - 1 || chars < share);
+                ++k)
+            chars += lengths[k] + 1;
+        parts[n].last = k;
+    }
+
+    started = 1;
+#ifndef _WIN32
+    if (threads > 1)
+    {
+        fill_widths();
+        for (; started < threads; ++started)
+        {
+            if (pthread_create(&parts[started].thread, NULL,
+                               run_batch_part, &parts[started]) != 0)
+                break;
+        }
+    }
+#endif
+    for (n = started; n < threads; ++n)
+        run_batch_part(&parts[n]);
+    run_batch_part(&parts[0]);
+#ifndef _WIN32
+    for (n = 1; n < started; ++n)
+        pthread_join(parts[n].thread, NULL);
+#endif
+
+    for (n = 0; n < threads; ++n)
+    {
+        if (parts[n].error)
+            return -1;
+    }
+    /* Append the lines of the other parts to those of the first */
+    for (n = 1; n < threads; ++n)
+    {
+        part_lines = parts[n].lines;
+        if (grow_batch_lines(lines, lines->count + part_lines->count,
+                             parts[n].last) < 0)
+            return -1;
+        memcpy(lines->begin + lines->count, part_lines->begin,
+               part_lines->count * sizeof(size_t));
+        memcpy(lines->end + lines->count, part_lines->end,
+               part_lines->count * sizeof(size_t));
+        memcpy(lines->indent + lines->count, part_lines->indent,
+               part_lines->count * sizeof(int));
+        memcpy(lines->hyphen + lines->count, part_lines->hyphen,
+               part_lines->count);
+        for (i = 1; i <= parts[n].last - parts[n].first; ++i)
+        {
+            lines->first[parts[n].first + i] =
+                lines->count + part_lines->first[i];
+        }
+        lines->count += part_lines->count;
+    }
+    return 0;
+}
+
+/*
+ * Hash "len" bytes, continuing from "hash".  All but the last part of
+ * the data must have a length that is a multiple of 8.
+ */
+static unsigned long long hash_bytes(const unsigned char *s, size_t len,
+                                     unsigned long long hash)
+{
+    unsigned long long word;
+
+    for (; len >= 8; s += 8, len -= 8)
+    {
+        memcpy(&word, s, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ULL;
+        hash ^= hash >> 32;
+    }
+    for (; len > 0; ++s, --len)
+    {
+        hash = (hash ^ *s) * 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+/* Longest paragraph whose lines are cached */
+#define MAXCACHED 4096
+
+/*
+ * A cached paragraph, allocated together with its lines (relative to
+ * the paragraph start) and its text, which follow it
+ */
+struct para_entry
+{
+    struct para_entry *chain;   /* Next in the hash bucket */
+    struct para_entry *newer;
+    struct para_entry *older;
+    unsigned long long hash;
+    unsigned long long options;
+    size_t len;
+    size_t count;
+};
+
+#define ENTRY_LINES(e)  ((struct line *)((e) + 1))
+#define ENTRY_TEXT(e)   ((wchar_t *)(ENTRY_LINES(e) + (e)->count))
+
+int para_cache_init(struct para_cache *cache, size_t capacity)
+{
+    size_t size = 16;
+
+    memset(cache, 0, sizeof *cache);
+    while (size < capacity * 2)
+        size *= 2;
+    if ( (cache->buckets = calloc(size, sizeof *cache->buckets)) == NULL)
+        return -1;
+    cache->mask = size - 1;
+    cache->capacity = capacity;
+    return 0;
+}
+
+void para_cache_free(struct para_cache *cache)
+{
+    struct para_entry *entry, *older;
+
+    for (entry = cache->newest; entry; entry = older)
+    {
+        older = entry->older;
+        free(entry);
+    }
+    free(cache->buckets);
+    free(cache->lines);
+    memset(cache, 0, sizeof *cache);
+}
+
+/* Hash of the options that change the lines of a paragraph */
+static unsigned long long options_hash(const char *lang)
+{
+    unsigned long long opts[4];
+
+    opts[0] = (unsigned long long)width;
+    opts[1] = (unsigned long long)keep_indent;
+    opts[2] = (unsigned long long)ambw;
+    opts[3] = (unsigned long long)(size_t)hyphen_trie;
+    return hash_bytes((const unsigned char *)lang, lang ? strlen(lang) : 0,
+                      hash_bytes((const unsigned char *)opts, sizeof opts,
+                                 0xCBF29CE484222325ULL));
+}
+
+static void unlink_entry(struct para_cache *cache, struct para_entry *entry)
+{
+    if (entry->newer)
+        entry->newer->older = entry->older;
+    else
+        cache->newest = entry->older;
+    if (entry->older)
+        entry->older->newer = entry->newer;
+    else
+        cache->oldest = entry->newer;
+}
+
+static void link_newest(struct para_cache *cache, struct para_entry *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache->newest;
+    if (cache->newest)
+        cache->newest->newer = entry;
+    else
+        cache->oldest = entry;
+    cache->newest = entry;
+}
+
+static struct para_entry *find_entry(struct para_cache *cache,
+                                     const wchar_t *text, size_t len,
+                                     unsigned long long hash,
+                                     unsigned long long options)
+{
+    struct para_entry *entry;
+
+    for (entry = cache->buckets[hash & cache->mask]; entry;
+            entry = entry->chain)
+    {
+        if (entry->hash == hash && entry->options == options &&
+                entry->len == len &&
+                wmemcmp(ENTRY_TEXT(entry), text, len) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+/* Cache the lines in cache->lines of the paragraph "text[len]" */
+static void add_entry(struct para_cache *cache, const wchar_t *text,
+                      size_t len, unsigned long long hash,
+                      unsigned long long options)
+{
+    struct para_entry *entry, **p;
+
+    if (cache->count == cache->capacity)
+    {   /* Evict the least recently used paragraph */
+        entry = cache->oldest;
+        for (p = &cache->buckets[entry->hash & cache->mask]; *p != entry;
+                p = &(*p)->chain)
+            ;
+        *p = entry->chain;
+        unlink_entry(cache, entry);
+        free(entry);
+        --cache->count;
+    }
+
+    entry = malloc(sizeof(struct para_entry) +
+                   cache->line_count * sizeof(struct line) +
+                   len * sizeof(wchar_t));
+    if (entry == NULL)
+        return;
+    entry->hash = hash;
+    entry->options = options;
+    entry->len = len;
+    entry->count = cache->line_count;
+    memcpy(ENTRY_LINES(entry), cache->lines,
+           entry->count * sizeof(struct line));
+    wmemcpy(ENTRY_TEXT(entry), text, len);
+    p = &cache->buckets[hash & cache->mask];
+    entry->chain = *p;
+    *p = entry;
+    link_newest(cache, entry);
+    ++cache->count;
+}
+
+/* Pass a line to "sink", and remember it relative to "begin" */
+static int put_cached_line(struct para_cache *cache, const wchar_t *buffer,
+                           const struct line *line, size_t begin,
+                           struct line_sink *sink)
+{
+    struct line *lines;
+    size_t capacity;
+
+    if (cache->line_count == cache->line_capacity)
+    {
+        capacity = cache->line_capacity ? cache->line_capacity * 2 : 64;
+        lines = realloc(cache->lines, capacity * sizeof(struct line));
+        if (lines == NULL)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        cache->lines = lines;
+        cache->line_capacity = capacity;
+    }
+    lines = &cache->lines[cache->line_count++];
+    *lines = *line;
+    lines->begin -= begin;
+    lines->end -= begin;
+    return sink->put_line(sink, buffer, line);
+}
+
+int break_paragraphs(const wchar_t *buffer, unsigned char *brks,
+                     unsigned char *widths, size_t len, const char *lang,
+                     struct para_cache *cache, struct line_sink *sink)
+{
+    const unsigned long long options = options_hash(lang);
+    unsigned long long hash = 0;
+    struct para_entry *entry;
+    struct line_iter it;
+    struct line line;
+    const wchar_t *lf;
+    size_t begin, end, i;
+
+    memset(brks, 0, BRKS_SIZE(len));
+    for (begin = 0; begin < len; begin = end)
+    {
+        lf = wmemchr(buffer + begin, L'\n', len - begin);
+        end = lf ? (size_t)(lf - buffer) + 1 : len;
+
+        if (short_lines && short_line_end(buffer, begin, len, width))
+        {   /* Cheaper to output than to look up */
+            line.begin = begin;
+            line.end = end - 1;
+            line.indent = 0;
+            line.hyphen = 0;
+            line.hard = 1;
+            if (sink->put_line(sink, buffer, &line))
+                return 1;
+            continue;
+        }
+
+        if (end - begin <= MAXCACHED)
+        {
+            hash = hash_bytes((const unsigned char *)(buffer + begin),
+                              (end - begin) * sizeof(wchar_t), options);
+            entry = find_entry(cache, buffer + begin, end - begin, hash,
+                               options);
+            if (entry)
+            {
+                ++cache->hits;
+                unlink_entry(cache, entry);
+                link_newest(cache, entry);
+                for (i = 0; i < entry->count; ++i)
+                {
+                    line = ENTRY_LINES(entry)[i];
+                    line.begin += begin;
+                    line.end += begin;
+                    if (sink->put_line(sink, buffer, &line))
+                        return 1;
+                }
+                continue;
+            }
+            ++cache->misses;
+        }
+
+        find_breaks_range(buffer, begin, end, lang, brks, chunk_brks);
+        set_widths_range(buffer, begin, end, widths);
+        cache->line_count = 0;
+        line_iter_init(&it, buffer, brks, widths, begin, end);
+        while (line_iter_next(&it, &line))
+        {
+            if (put_cached_line(cache, buffer, &line, begin, sink))
+                return 1;
+        }
+        if (end - begin <= MAXCACHED)
+            add_entry(cache, buffer + begin, end - begin, hash, options);
+    }
+    return 0;
+}
+
+/*
+ * Width of buffer[begin..end) without the trailing spaces.  ASCII
+ * characters are taken as one column wide, as set_widths does, so that
+ * the widths of the short lines are not needed.
+ */
+static int visible_width(const wchar_t *buffer, const unsigned char *widths,
+                         size_t begin, size_t end)
+{
+    int col = 0, visible = 0;
+
+    for (; begin < end; ++begin)
+    {
+        col += buffer[begin] < 0x80 ? 1 : widths[begin];
+        if (buffer[begin] != L' ')
+            visible = col;
+    }
+    return visible;
+}
+
+void measure_text(const wchar_t *buffer, unsigned char *brks,
+                  const unsigned char *widths, size_t len,
+                  struct text_metrics *metrics)
+{
+    struct line_iter it;
+    struct line line;
+    int w;
+
+    memset(metrics, 0, sizeof *metrics);
+    line_iter_init(&it, buffer, brks, widths, 0, len);
+    while (line_iter_next(&it, &line))
+    {
+        ++metrics->lines;
+        w = line.indent + (line.hyphen ? 1 : 0) +
+            visible_width(buffer, widths, line.begin, line.end);
+        if (metrics->max_width < w)
+            metrics->max_width = w;
+        if (!line.hard && !line.hyphen && line.end > line.begin &&
+                GET_BRK(brks, line.end - 1) != LINEBREAK_ALLOWBREAK)
+            ++metrics->forced_cuts;
+    }
+}
+
+/* Width of the longest unbreakable part of buffer[begin..end) */
+static int longest_segment_range(const wchar_t *buffer, unsigned char *brks,
+                                 const unsigned char *widths, size_t begin,
+                                 size_t end, int longest)
+{
+    int col = 0, visible = 0;
+    wchar_t ch;
+    size_t i;
+
+    apply_cpp_rule(buffer, brks, begin, end);
+    for (i = begin; i < end; ++i)
+    {
+        ch = buffer[i];
+        col += ch < 0x80 ? 1 : widths[i];
+        if (ch > L' ' && (ch < 0x7F || !iswspace(ch)))
+            visible = col;
+        /* Not at LINEBREAK_INSIDEACHAR, which is inside a surrogate
+         * pair where wchar_t is UTF-16 */
+        if (GET_BRK(brks, i) < LINEBREAK_NOBREAK)
+        {
+            if (longest < visible)
+                longest = visible;
+            col = visible = 0;
+        }
+    }
+    return longest;
+}
+
+int longest_segment(const wchar_t *buffer, unsigned char *brks,
+                    const unsigned char *widths, size_t len,
+                    const char *lang)
+{
+    size_t begin, end;
+    int longest = 0;
+
+    if (!short_lines)
+        return longest_segment_range(buffer, brks, widths, 0, len, 0);
+    for (begin = skip_short_lines(buffer, 0, len); begin < len;
+            begin = skip_short_lines(buffer, end, len))
+    {
+        end = skip_long_lines(buffer, begin, len);
+        longest = longest_segment_range(buffer, brks, widths, begin, end,
+                                        longest);
+    }
+
+    /* Find the breaks of the short lines that are wider than the longest
+     * part found, as only those may contain a longer one */
+    for (begin = 0; begin < len; begin = end)
+    {
+        if ( (end = short_line_end(buffer, begin, len, width)) == 0)
+        {
+            end = skip_long_lines(buffer, begin, len);
+            continue;
+        }
+        if (visible_width(buffer, widths, begin, end - 1) > longest)
+        {
+            find_breaks_range(buffer, begin, end, lang, brks, chunk_brks);
+            longest = longest_segment_range(buffer, brks, widths, begin,
+                                            end, longest);
+        }
+    }
+    return longest;
+}
+
+#define CHECKPOINT_CHARS (16*1024)
+
+/* Sink that only counts the lines */
+struct count_sink
+{
+    struct line_sink sink;
+    size_t count;
+};
+
+static int count_put_line(struct line_sink *sink, const wchar_t *buffer,
+                          const struct line *line)
+{
+    (void)buffer;
+    (void)line;
+    ++((struct count_sink *)sink)->count;
+    return 0;
+}
+
+/* Sink that skips "skip" lines, and passes "count" lines to "target" */
+struct range_sink
+{
+    struct line_sink sink;
+    struct line_sink *target;
+    size_t skip;
+    size_t count;
+    size_t passed;
+};
+
+static int range_put_line(struct line_sink *sink, const wchar_t *buffer,
+                          const struct line *line)
+{
+    struct range_sink *range = (struct range_sink *)sink;
+
+    if (range->skip)
+    {
+        --range->skip;
+        return 0;
+    }
+    ++range->passed;
+    if (range->target->put_line(range->target, buffer, line))
+        return 1;
+    return range->passed == range->count;
+}
+
+int viewport_init(struct viewport *vp, const wchar_t *buffer,
+                  unsigned char *brks, const unsigned char *widths,
+                  size_t len)
+{
+    vp->buffer = buffer;
+    vp->brks = brks;
+    vp->widths = widths;
+    vp->len = len;
+    vp->capacity = 64;
+    vp->positions = malloc(vp->capacity * sizeof(size_t));
+    vp->lines = malloc(vp->capacity * sizeof(size_t));
+    if (vp->positions == NULL || vp->lines == NULL)
+    {
+        viewport_free(vp);
+        return -1;
+    }
+    vp->positions[0] = 0;
+    vp->lines[0] = 0;
+    vp->count = 1;
+    return 0;
+}
+
+void viewport_free(struct viewport *vp)
+{
+    free(vp->positions);
+    free(vp->lines);
+    vp->positions = NULL;
+    vp->lines = NULL;
+    vp->count = vp->capacity = 0;
+}
+
+/*
+ * Add a checkpoint at the first paragraph start at least
+ * CHECKPOINT_CHARS after the last one, counting the lines in between.
+ * Returns -1 if there is no memory for it.
+ */
+static int add_checkpoint(struct viewport *vp)
+{
+    struct count_sink counter;
+    size_t begin = vp->positions[vp->count - 1];
+    size_t end = begin + CHECKPOINT_CHARS;
+    const wchar_t *lf;
+    size_t *new_positions;
+    size_t *new_lines;
+
+    if (vp->count == vp->capacity)
+    {
+        new_positions = realloc(vp->positions,
+                                vp->capacity * 2 * sizeof(size_t));
+        if (new_positions == NULL)
+            return -1;
+        vp->positions = new_positions;
+        new_lines = realloc(vp->lines, vp->capacity * 2 * sizeof(size_t));
+        if (new_lines == NULL)
+            return -1;
+        vp->lines = new_lines;
+        vp->capacity *= 2;
+    }
+
+    if (end >= vp->len)
+    {
+        end = vp->len;
+    }
+    else
+    {
+        lf = wmemchr(vp->buffer + end - 1, L'\n', vp->len - end + 1);
+        end = lf ? (size_t)(lf - vp->buffer) + 1 : vp->len;
+    }
+
+    counter.sink.put_line = count_put_line;
+    counter.count = 0;
+    break_text(vp->buffer, vp->brks, vp->widths, begin, end, &counter.sink);
+    vp->positions[vp->count] = end;
+    vp->lines[vp->count] = vp->lines[vp->count - 1] + counter.count;
+    ++vp->count;
+    return 0;
+}
+
+/*
+ * Output lines are only counted up to the checkpoint after "first", so
+ * the cost is proportional to the distance from the last checkpoint
+ * (or that from the start, for the first visit).
+ */
+size_t viewport_output(struct viewport *vp, size_t first, size_t count,
+                       struct line_sink *sink)
+{
+    struct range_sink range;
+    size_t bot, top, mid;
+
+    if (count == 0)
+        return 0;
+
+    while (vp->lines[vp->count - 1] <= first &&
+            vp->positions[vp->count - 1] < vp->len)
+    {
+        if (add_checkpoint(vp) < 0)
+            break;
+    }
+
+    /* Find the last checkpoint not after the first line */
+    bot = 0;
+    top = vp->count;
+    while (top - bot > 1)
+    {
+        mid = (bot + top) / 2;
+        if (vp->lines[mid] <= first)
+            bot = mid;
+        else
+            top = mid;
+    }
+
+    range.sink.put_line = range_put_line;
+    range.target = sink;
+    range.skip = first - vp->lines[bot];
+    range.count = count;
+    range.passed = 0;
+    break_text(vp->buffer, vp->brks, vp->widths, vp->positions[bot],
+               vp->len, &range.sink);
+    return range.passed;
+}
+
+/*
+ * Read a character in filter mode.  The input is read directly from the
+ * file descriptor, or through zinput if it is set (except on Windows),
+ * so that the wait can be limited
+ * to "msec" milliseconds (a negative value means no limit).  WEOF is
+ * returned at the end of input or when the wait times out; "*timed_out"
+ * tells the two apart.
+ */
+static wint_t filter_getwc(FILE *fp_in, int msec, int *timed_out)
+{
+#ifdef _WIN32
+    (void)msec;
+    *timed_out = 0;
+    return getwc(fp_in);
+#else
+    static char bytes[BUFSIZ];
+    static size_t pos, end;
+    static mbstate_t state;
+    struct pollfd pfd;
+    wchar_t wc;
+    size_t n;
+    ssize_t count;
+
+    *timed_out = 0;
+    for (;;)
+    {
+        if (pos < end)
+        {
+            n = mbrtowc(&wc, bytes + pos, end - pos, &state);
+            if (n == (size_t)-2)
+            {   /* Incomplete character; the bytes are kept in state */
+                pos = end;
+            }
+            else if (n == (size_t)-1)
+            {   /* Invalid sequence: skip a byte */
+                memset(&state, 0, sizeof state);
+                ++pos;
+                return 0xFFFD;
+            }
+            else
+            {
+                pos += n ? n : 1;
+                return wc;
+            }
+        }
+
+        if (msec >= 0 && !(zinput && zio_pending(zinput)))
+        {
+            pfd.fd = fileno(fp_in);
+            pfd.events = POLLIN;
+            if (poll(&pfd, 1, msec) == 0)
+            {
+                *timed_out = 1;
+                return WEOF;
+            }
+        }
+        if (zinput)
+            count = zio_read(zinput, bytes, sizeof bytes);
+        else
+            count = read(fileno(fp_in), bytes, sizeof bytes);
+        if (count <= 0)
+        {
+            return WEOF;
+        }
+        pos = 0;
+        end = (size_t)count;
+    }
+#endif
+}
+
+/*
+ * Break the text in filter mode.  Each paragraph is broken and flushed
+ * as soon as the line feed ending it is read, and an incomplete one is
+ * output when the input is idle for more than timeout milliseconds.
+ */
+void filter_text(FILE *fp_in, FILE *fp_out)
+{
+    struct file_sink out;
+    size_t len = 0;
+    wint_t wch;
+    int timed_out;
+    int at_start = 1;           /* Nothing has been read yet */
+    int n;
+    pctimer_t t0, t1, t2;
+
+    init_file_sink(&out, fp_out);
+    t0 = pctimer();
+    for (;;)
+    {
+        wch = filter_getwc(fp_in, len ? timeout : -1, &timed_out);
+        if (wch == WEOF && !timed_out && len == 0)
+            break;
+        if (wch != WEOF)
+        {
+            /* Only a byte order mark starting the input is skipped */
+            if (wch == BOM && at_start)
+            {
+                at_start = 0;
+                continue;
+            }
+            at_start = 0;
+            buffer[len++] = wch;
+            if (wch != L'\n' && len < MAXCHARS - 1)
+                continue;
+        }
+        if (timed_out || (wch != L'\n' && wch != WEOF))
+        {
+            /* End the incomplete paragraph with a forced break */
+            buffer[len++] = L'\n';
+        }
+
+        t1 = pctimer();
+        if (para_cache.capacity)
+        {
+            break_paragraphs(buffer, brks, widths, len, lang, &para_cache,
+                             &out.sink);
+        }
+        else
+        {
+            find_breaks(buffer, len, lang, brks);
+            set_widths(buffer, len, widths);
+            break_text(buffer, brks, widths, 0, len, &out.sink);
+        }
+        fflush(fp_out);
+        t2 = pctimer();
+
+        for (n = 0; n < MAXLATENCY && (t2 - t1) * 1e6 >= (1 << n); ++n)
+            ;
+        ++latencies[n];
+        trace_span("Reading", 0, t0, t1, NULL);
+        trace_span("Paragraph", 0, t1, t2, "\"chars\": %lu",
+                   (unsigned long)len);
+        t0 = t2;
+        len = 0;
+        if (wch == WEOF && !timed_out)
+            break;
+    }
+}
+
+#ifndef BREAKTEXT_NO_MAIN
+
+/*
+ * Allocate "size" bytes of zeroed memory.  Large blocks are backed by
+ * huge pages if possible: explicit ones if reserved, or else
+ * transparent ones.  If "populate" is nonzero, the pages are faulted in
+ * at once, instead of one by one as the text is read.
+ */
+static void *alloc_pages(size_t size, int populate)
+{
+#ifdef _WIN32
+    (void)populate;
+    return calloc(size, 1);
+#else
+    char *ptr;
+    size_t i;
+
+#ifdef MAP_HUGETLB
+    if (size >= HUGEPAGE)
+    {
+        ptr = mmap(NULL, (size + HUGEPAGE - 1) & ~(size_t)(HUGEPAGE - 1),
+                   PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB |
+                   (populate ? MAP_POPULATE : 0), -1, 0);
+        if (ptr != MAP_FAILED)
+            return ptr;
+    }
+#endif
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED)
+        return NULL;
+#ifdef MADV_HUGEPAGE
+    if (size >= HUGEPAGE)
+        madvise(ptr, size, MADV_HUGEPAGE);
+#endif
+    /* MAP_POPULATE would fault the pages in before madvise, and small
+     * blocks are cheap to fault in as they are used */
+    if (populate && size >= HUGEPAGE)
+    {
+#ifdef MADV_POPULATE_WRITE
+        if (madvise(ptr, size, MADV_POPULATE_WRITE) == 0)
+            return ptr;
+#endif
+        for (i = 0; i < size; i += 4096)
+            ((volatile char *)ptr)[i] = 0;
+    }
+    return ptr;
+#endif
+}
+
+/*
+ * Allocate buffer, brks, and widths for "chars" characters.
+ */
+static void alloc_buffers(size_t chars, int populate)
+{
+    buffer = alloc_pages(chars * sizeof(wchar_t), populate);
+    brks = alloc_pages(BRKS_SIZE(chars), populate);
+    widths = alloc_pages(chars, populate);
+    if (buffer == NULL || brks == NULL || widths == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+/*
+ * Header of the index file, which is followed by the text, the packed
+ * breaking opportunities, and the widths.  An index is only valid for
+ * the same input content, libunibreak version, locale, and language.
+ */
+struct index_header
+{
+    char magic[4];              /* "BTIX" */
+    unsigned int unibreak_version;
+    unsigned int wchar_size;
+    unsigned int ambw;
+    unsigned int encoding;      /* ENC_LOCALE to ENC_CJK */
+    unsigned long long hash;
+    unsigned long long len;
+    char locale[32];
+    char lang[32];
+    char codec[16];             /* Name of cjk_codec with ENC_CJK */
+};
+
+/*
+ * Hash the content of the file.  It is opened separately, as reading
+ * bytes would prevent reading wide characters from the same stream.
+ */
+static unsigned long long hash_file(const char *filename)
+{
+    static unsigned char bytes[64*1024];
+    unsigned long long hash = 0xCBF29CE484222325ULL;
+    size_t count;
+    FILE *fp;
+
+    if ( (fp = fopen(filename, "rb")) == NULL)
+    {
+        perror("Cannot open input file");
+        exit(1);
+    }
+    while ( (count = fread(bytes, 1, sizeof bytes, fp)) > 0)
+    {
+        hash = hash_bytes(bytes, count, hash);
+    }
+    fclose(fp);
+    return hash;
+}
+
+static void init_index_header(struct index_header *header,
+                              unsigned long long hash, size_t len)
+{
+    memset(header, 0, sizeof(struct index_header));
+    memcpy(header->magic, INDEX_MAGIC, sizeof header->magic);
+    header->unibreak_version = (unsigned int)unibreak_version;
+    header->wchar_size = sizeof(wchar_t);
+    header->ambw = (unsigned int)ambw;
+    header->encoding = (unsigned int)encoding;
+    header->hash = hash;
+    header->len = len;
+    strncpy(header->locale, setlocale(LC_CTYPE, NULL),
+            sizeof header->locale - 1);
+    if (lang)
+        strncpy(header->lang, lang, sizeof header->lang - 1);
+    if (encoding == ENC_CJK)
+        strncpy(header->codec, cjk_codec_name(cjk_codec),
+                sizeof header->codec - 1);
+}
+
+/*
+ * Write the analysed text to the index file.
+ */
+static int save_index(const char *filename, unsigned long long hash,
+                      const wchar_t *buffer, const unsigned char *brks,
+                      const unsigned char *widths, size_t len)
+{
+    struct index_header header;
+    FILE *fp;
+    int result = -1;
+
+    init_index_header(&header, hash, len);
+    if ( (fp = fopen(filename, "wb")) == NULL)
+        return -1;
+    if (fwrite(&header, sizeof header, 1, fp) == 1 &&
+            fwrite(buffer, sizeof(wchar_t), len, fp) == len &&
+            fwrite(brks, 1, BRKS_SIZE(len), fp) == BRKS_SIZE(len) &&
+            fwrite(widths, 1, len, fp) == len)
+    {
+        result = 0;
+    }
+    if (fclose(fp) != 0)
+        result = -1;
+    return result;
+}
+
+/*
+ * Map the index file if it is valid for the input with "hash".  On
+ * success, the pointers are set to the analysed text in it (on Windows,
+ * it is read into newly allocated buffers), and the length of the text
+ * is returned; otherwise (size_t)-1 is returned.  The mapping is
+ * private, so break_text may still modify brks.
+ */
+static size_t load_index(const char *filename, unsigned long long hash,
+                         wchar_t **text, unsigned char **text_brks,
+                         unsigned char **text_widths)
+{
+    struct index_header expected;
+    struct index_header *header;
+    size_t len;
+#ifdef _WIN32
+    struct index_header file_header;
+    FILE *fp;
+
+    if ( (fp = fopen(filename, "rb")) == NULL)
+        return (size_t)-1;
+    header = &file_header;
+    if (fread(header, sizeof *header, 1, fp) != 1 ||
+            header->len > MAXCHARS)
+    {
+        fclose(fp);
+        return (size_t)-1;
+    }
+    len = (size_t)header->len;
+    init_index_header(&expected, hash, len);
+    if (memcmp(header, &expected, sizeof expected) != 0)
+    {
+        fclose(fp);
+        return (size_t)-1;
+    }
+    alloc_buffers(len ? len : 1, 1);
+    if (fread(buffer, sizeof(wchar_t), len, fp) != len ||
+            fread(brks, 1, BRKS_SIZE(len), fp) != BRKS_SIZE(len) ||
+            fread(widths, 1, len, fp) != len)
+    {
+        fclose(fp);
+        return (size_t)-1;
+    }
+    fclose(fp);
+    *text = buffer;
+    *text_brks = brks;
+    *text_widths = widths;
+#else
+    unsigned char *data;
+    struct stat st;
+    int fd;
+
+    if ( (fd = open(filename, O_RDONLY)) < 0)
+        return (size_t)-1;
+    if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof *header)
+    {
+        close(fd);
+        return (size_t)-1;
+    }
+    data = mmap(NULL, (size_t)st.st_size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return (size_t)-1;
+    header = (struct index_header *)data;
+    len = (size_t)header->len;
+    init_index_header(&expected, hash, len);
+    if (memcmp(header, &expected, sizeof expected) != 0 ||
+            (size_t)st.st_size != sizeof *header + len * sizeof(wchar_t) +
+                                  BRKS_SIZE(len) + len)
+    {
+        munmap(data, (size_t)st.st_size);
+        return (size_t)-1;
+    }
+    data += sizeof *header;
+    *text = (wchar_t *)data;
+    data += len * sizeof(wchar_t);
+    *text_brks = data;
+    data += BRKS_SIZE(len);
+    *text_widths = data;
+#endif
+    return len;
+}
+
+/*
+ * Sink that writes the break offsets (-b) instead of the text.  The
+ * output starts with OFFSET_MAGIC and a byte for the size of the
+ * offset unit: 1 for bytes in the locale encoding or the CJK encoding
+ * given with -e, 2 for UTF-16 code units, or 4 for characters (UTF-32
+ * code units).  With -bc, it is the size of wchar_t; with -bu, it is
+ * the size of the code units of the input, so that the offsets point
+ * into the input file as is (after a byte order mark).  Each line is
+ * followed by two unsigned LEB128 numbers:
+ *
+ *   (end - previous end) << 2 | hyphen << 1 | hard
+ *   indent
+ *
+ * where "end" is the offset where the text of the line ends (after
+ * trailing spaces, and at the line feed for a hard break).
+ */
+struct offset_sink
+{
+    struct line_sink sink;
+    FILE *fp;
+    size_t pos;                 /* Characters converted to offset */
+    unsigned long long offset;  /* Offset of buffer[pos] */
+    unsigned long long last;    /* Offset of the last line end */
+    mbstate_t state;
+};
+
+static void put_varint(unsigned long long n, FILE *fp)
+{
+    while (n >= 0x80)
+    {
+        putc((int)(n & 0x7F) | 0x80, fp);
+        n >>= 7;
+    }
+    putc((int)n, fp);
+}
+
+static int offset_put_line(struct line_sink *sink, const wchar_t *buffer,
+                           const struct line *line)
+{
+    struct offset_sink *out = (struct offset_sink *)sink;
+    char bytes[MB_LEN_MAX];
+    unsigned char cjk_bytes[CJK_MAXBYTES];
+    size_t n;
+
+    if (offset_unit == (int)sizeof(wchar_t))
+    {
+        out->offset = line->end;
+    }
+    else if (offset_unit == 1)
+    {
+        for (; out->pos < line->end; ++out->pos)
+        {
+            if (encoding == ENC_CJK)
+            {
+                out->offset += cjk_encode(cjk_codec, buffer[out->pos],
+                                          cjk_bytes);
+                continue;
+            }
+            n = wcrtomb(bytes, buffer[out->pos], &out->state);
+            if (n == (size_t)-1)
+            {   /* Not encodable; it was read as an invalid byte */
+                memset(&out->state, 0, sizeof out->state);
+                n = 1;
+            }
+            out->offset += n;
+        }
+    }
+    else if (offset_unit == 2)
+    {   /* wchar_t is UTF-32 */
+        for (; out->pos < line->end; ++out->pos)
+            out->offset += (unsigned long)buffer[out->pos] >= 0x10000 ? 2 : 1;
+    }
+    else
+    {   /* wchar_t is UTF-16, and a trailing surrogate is not counted */
+        for (; out->pos < line->end; ++out->pos)
+        {
+            if (!(buffer[out->pos] >= 0xDC00 && buffer[out->pos] < 0xE000 &&
+                  out->pos > 0 && buffer[out->pos - 1] >= 0xD800 &&
+                  buffer[out->pos - 1] < 0xDC00))
+                ++out->offset;
+        }
+    }
+    put_varint((out->offset - out->last) << 2 | (line->hyphen ? 2 : 0) |
+               (line->hard ? 1 : 0), out->fp);
+    put_varint((unsigned long long)line->indent, out->fp);
+    out->last = out->offset;
+    return 0;
+}
+
+static void init_offset_sink(struct offset_sink *sink, FILE *fp)
+{
+    memset(sink, 0, sizeof(struct offset_sink));
+    sink->sink.put_line = offset_put_line;
+    sink->fp = fp;
+#ifdef _WIN32
+    if (fp == stdout)
+        _setmode(_fileno(stdout), _O_BINARY);
+#endif
+    fputs(OFFSET_MAGIC, fp);
+    putc(offset_unit, fp);
+}
+
+/*
+ * Sink that writes the lines in the CJK encoding given with -e.
+ */
+struct cjk_sink
+{
+    struct line_sink sink;
+    FILE *fp;
+};
+
+static void put_cjk(unsigned long ch, FILE *fp_out)
+{
+    unsigned char bytes[CJK_MAXBYTES];
+
+    fwrite(bytes, 1, cjk_encode(cjk_codec, ch, bytes), fp_out);
+}
+
+static int cjk_put_line(struct line_sink *sink, const wchar_t *buffer,
+                        const struct line *line)
+{
+    FILE *fp_out = ((struct cjk_sink *)sink)->fp;
+    unsigned long ch;
+    size_t i;
+    int n;
+
+    for (n = 0; n < line->indent; ++n)
+        putc(' ', fp_out);
+    for (i = line->begin; i < line->end; ++i)
+    {
+        ch = (unsigned long)buffer[i];
+        if (sizeof(wchar_t) == 2 && ch >= 0xD800 && ch < 0xDC00 &&
+                i + 1 < line->end &&
+                buffer[i + 1] >= 0xDC00 && buffer[i + 1] < 0xE000)
+        {   /* Surrogate pair */
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (buffer[++i] - 0xDC00);
+        }
+        put_cjk(ch, fp_out);
+    }
+    if (line->hyphen)
+        putc('-', fp_out);
+    putc('\n', fp_out);
+    return 0;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+        "Usage: breaktext [OPTION]... <Input File> [Output File]\n"
+        "Last Change: 2024-03-05 22:57:00 +0800 (libunibreak %d.%d)\n"
+        "\n"
+        "Available options:\n"
+        "  -L<locale>   Locale of the console (system locale by default)\n"
+        "  -l<lang>     Language of input (asssume no language by default)\n"
+        "  -w<width>    Width of output text (72 by default)\n"
+        "  -i           Keep space indentation\n"
+        "  -h<file>     Hyphenate words with the compiled patterns in <file>\n"
+        "  -H<file>     Compile the hyphenation patterns in the input (in the\n"
+        "               TeX format) into <file>, instead of breaking text\n"
+        "  -x<file>     Use <file> as an index of the analysed input, which is\n"
+        "               written if it does not match the input\n"
+        "  -r<n>[,<m>]  Output only lines <n> to <m> (or the end) of the result\n"
+        "  -e<enc>      Encoding of input: utf-16le, utf-16be, utf-32le, or\n"
+        "               utf-32be (detected from the byte order mark of an\n"
+        "               input file on POSIX systems; the locale by default);\n"
+        "               or of input and output: gb18030, gbk, big5,\n"
+        "               shift_jis, euc-jp, or euc-kr\n"
+        "  -b<unit>     Output the break offsets in binary, instead of the text,\n"
+        "               in <unit>: `b' for bytes in the locale (or -e)\n"
+        "               encoding, `c' for wchar_t characters, or `u' for code\n"
+        "               units of the input encoding\n"
+        "  -m<w>[,...]  Output, instead of the text, the number of lines, the\n"
+        "               widest line, and the lines cut inside a word at each\n"
+        "               width <w>, and the widest part that cannot be broken\n"
+        "  -z<format>   Compress the output in <format>: gzip (or zstd, if\n"
+        "               built with it); compressed input is detected on\n"
+        "               POSIX systems\n"
+        "  -j<n>        Lay out long text with <n> threads (POSIX only)\n"
+        "  -c<n>        Cache the lines of up to <n> paragraphs, so that repeated\n"
+        "               ones are not broken again\n"
+        "  -p<n>        Output, instead of the text, the byte ranges of <n>\n"
+        "               parts of the input split between paragraphs, to be\n"
+        "               broken separately with -s (POSIX only)\n"
+        "  -s<b>,<e>    Break only bytes <b> to <e> of the input, so that the\n"
+        "               outputs of the parts from -p can be concatenated\n"
+        "  -T<file>     Write the timeline of the stages (and of the threads)\n"
+        "               to <file> in the Chrome trace format\n"
+        "  -f           Filter mode: output each paragraph once it is complete\n"
+        "  -t<msec>     Output an incomplete paragraph after <msec> ms without\n"
+        "               input in filter mode (POSIX only)\n"
+        "  -v           Be verbose (twice to report the hardware counters of\n"
+        "               each stage on Linux)\n"
+        "\n"
+        "If the output file is omitted, stdout will be used.\n"
+        "The input file cannot be omitted, but you may use `-' for stdin.\n"
+        "\n"
+        "The `native' wide character type (wchar_t) is used in I/O routines,\n"
+        "and the encoding used is platform-dependent.  On POSIX-compliant\n"
+        "systems, the environment variables LANG, LC_ALL, and LC_CTYPE\n"
+        "control the locale/encoding (unless overridden with the -L option),\n"
+        "and UTF-8 will probably be used by default on modern systems.  On\n"
+        "Windows, the encoding is dependent on whether stdin/stdout is used\n"
+        "for I/O: console I/O will be automatically converted to/from\n"
+        "wchar_t (which is UTF-16) according to the system locale setting\n"
+        "(overridable with -L), but files (excepting the stdin/stdout case)\n"
+        "will always be in just wchar_t (UTF-16).\n",
+        (unibreak_version >> 8), (unibreak_version & 0xFF)
+    );
+}
+
+/*
+ * Find how many characters may be read from the input: as each
+ * character takes at least a byte, no more than the file size (up to
+ * MAXCHARS), or than the shard.  Returns 0 if the input is not a
+ * regular file.
+ */
+static size_t max_input_chars(FILE *fp_in)
+{
+    unsigned long long size;
+#ifdef _WIN32
+    struct _stat64 st;
+
+    if (_fstat64(_fileno(fp_in), &st) == 0 && (st.st_mode & _S_IFREG))
+#else
+    struct stat st;
+
+    if (fstat(fileno(fp_in), &st) == 0 && S_ISREG(st.st_mode))
+#endif
+    {
+        size = shard_end ? shard_end - shard_begin :
+                           (unsigned long long)st.st_size;
+        if (size >= MAXCHARS)
+            return MAXCHARS;
+        return size ? (size_t)size : 1;
+    }
+    return 0;
+}
+
+#ifdef _WIN32
+/*
+ * Read at most "max_chars" characters of input into buffer, and return
+ * the number of characters.
+ */
+static size_t load_text(FILE *fp_in, size_t max_chars)
+{
+    size_t c;
+    wint_t wch;
+
+    for (c = 0; c < max_chars; ++c)
+    {
+        wch = getwc(fp_in);
+        if (wch == WEOF)
+            break;
+        buffer[c] = wch;
+    }
+
+    if (buffer[0] == SWAPBYTE(BOM))
+    {
+        fprintf(stderr, "Wrong endianness of input\n");
+        exit(1);
+    }
+    if (buffer[0] == BOM && c > 1)
+    {
+        memmove(buffer, buffer + 1, (--c) * sizeof(wchar_t));
+    }
+    return c;
+}
+#endif
+
+static const char *encoding_names[] =
+{
+    "locale", "utf-16le", "utf-16be", "utf-32le", "utf-32be"
+};
+
+/*
+ * Find the encoding from the byte order mark of the input.  It is read
+ * with pread, which does not touch the stream.  Non-seekable input is
+ * assumed to be in the locale encoding.
+ */
+static int detect_encoding(FILE *fp_in)
+{
+#ifdef _WIN32
+    (void)fp_in;
+#else
+    unsigned char bom[4];
+    ssize_t n = pread(fileno(fp_in), bom, sizeof bom, 0);
+
+    if (n >= 4 && memcmp(bom, "\xFF\xFE\0\0", 4) == 0)
+        return ENC_UTF32LE;
+    if (n >= 4 && memcmp(bom, "\0\0\xFE\xFF", 4) == 0)
+        return ENC_UTF32BE;
+    if (n >= 2 && memcmp(bom, "\xFF\xFE", 2) == 0)
+        return ENC_UTF16LE;
+    if (n >= 2 && memcmp(bom, "\xFE\xFF", 2) == 0)
+        return ENC_UTF16BE;
+#endif
+    return ENC_LOCALE;
+}
+
+/*
+ * Size of the code units of the input for -bu.  On Windows, files in
+ * the locale encoding are read as wchar_t.
+ */
+static int input_unit(FILE *fp_in)
+{
+    if (encoding == ENC_UTF16LE || encoding == ENC_UTF16BE)
+        return 2;
+    if (encoding == ENC_UTF32LE || encoding == ENC_UTF32BE)
+        return 4;
+#ifdef _WIN32
+    if (encoding == ENC_LOCALE && fp_in != stdin)
+        return sizeof(wchar_t);
+#else
+    (void)fp_in;
+#endif
+    return 1;
+}
+
+#ifndef _WIN32
+/*
+ * Write the byte ranges of about "shards" parts of the input file, as
+ * "<begin> <end>" lines, for breaking them separately with -s.  Each
+ * part but the last ends after a line feed, after which the layout
+ * starts afresh, so the outputs of the parts concatenated are the
+ * output of the whole file.  More parts are made if needed to keep
+ * each well under MAXCHARS.
+ */
+static void plan_shards(FILE *fp_in, int shards, FILE *fp_out)
+{
+    static unsigned char bytes[64*1024];
+    static const char *lfs[] =
+    {
+        "\n", "\n\0", "\0\n", "\n\0\0\0", "\0\0\0\n"
+    };
+    const char *lf = lfs[encoding == ENC_CJK ? ENC_LOCALE : encoding];
+    size_t unit = encoding == ENC_UTF16LE || encoding == ENC_UTF16BE ? 2 :
+                  encoding == ENC_UTF32LE || encoding == ENC_UTF32BE ? 4 : 1;
+    unsigned long long size, begin, pos;
+    struct stat st;
+    ssize_t n, i;
+    int k;
+
+    if (fstat(fileno(fp_in), &st) != 0)
+    {
+        perror("Cannot read input file");
+        exit(1);
+    }
+    size = (unsigned long long)st.st_size;
+    if (size / (MAXCHARS / 2) >= (unsigned long long)shards)
+        shards = (int)(size / (MAXCHARS / 2)) + 1;
+
+    for (begin = 0, k = 1; k < shards; ++k)
+    {
+        pos = size / shards * k;
+        if (pos < begin)
+            pos = begin;
+        pos -= pos % unit;
+        for (;;)
+        {   /* Find the next line feed */
+            n = pread(fileno(fp_in), bytes, sizeof bytes, (off_t)pos);
+            if (n < 0)
+            {
+                perror("Cannot read input file");
+                exit(1);
+            }
+            for (i = 0; i + (ssize_t)unit <= n &&
+                        memcmp(bytes + i, lf, unit) != 0; i += unit)
+                ;
+            if (i + (ssize_t)unit <= n)
+            {
+                pos += i + unit;
+                break;
+            }
+            if (n < (ssize_t)unit)
+            {
+                pos = size;
+                break;
+            }
+            pos += n - n % unit;
+        }
+        if (pos >= size)
+            break;
+        fprintf(fp_out, "%llu %llu\n", begin, pos);
+        begin = pos;
+    }
+    fprintf(fp_out, "%llu %llu\n", begin, size);
+}
+#endif
+
+/*
+ * Decode the UTF-16 in "bytes[len]" into "text", which has room for
+ * "room" characters, swapping the bytes if "swap" is nonzero.  Unless
+ * "final" is nonzero, a unit or surrogate pair cut at the end is left
+ * for the next call.  Returns the number of characters stored, and
+ * stores the number of bytes used in "*used".
+ */
+static size_t decode_utf16(const unsigned char *bytes, size_t len,
+                           int swap, int final, wchar_t *text, size_t room,
+                           size_t *used)
+{
+    unsigned short units[8];
+    unsigned int u, u2, surrogates;
+    size_t i = 0, c = 0;
+    int j;
+
+    while (c < room)
+    {
+        /* Fast path for 8 units without surrogates, written so that the
+         * compiler can vectorize it */
+        if (len - i >= 16 && room - c >= 8)
+        {
+            memcpy(units, bytes + i, 16);
+            surrogates = 0;
+            for (j = 0; j < 8; ++j)
+            {
+                if (swap)
+                    units[j] = (unsigned short)SWAPBYTE(units[j]);
+                surrogates |= (units[j] & 0xF800) == 0xD800;
+            }
+            if (!surrogates || sizeof(wchar_t) == 2)
+            {
+                for (j = 0; j < 8; ++j)
+                    text[c + j] = (wchar_t)units[j];
+                i += 16;
+                c += 8;
+                continue;
+            }
+        }
+
+        if (len - i < 2)
+            break;
+        memcpy(units, bytes + i, len - i >= 4 ? 4 : 2);
+        u = swap ? SWAPBYTE(units[0]) : units[0];
+        if (sizeof(wchar_t) == 2 || (u & 0xF800) != 0xD800)
+        {   /* Surrogates are kept as is in a 16-bit wchar_t */
+            text[c++] = (wchar_t)u;
+            i += 2;
+            continue;
+        }
+        if (u < 0xDC00)
+        {
+            if (len - i < 4 && !final)
+                break;
+            if (len - i >= 4)
+            {
+                u2 = swap ? SWAPBYTE(units[1]) : units[1];
+                if (u2 >= 0xDC00 && u2 < 0xE000)
+                {
+                    text[c++] = (wchar_t)(0x10000 + ((u - 0xD800) << 10) +
+                                          (u2 - 0xDC00));
+                    i += 4;
+                    continue;
+                }
+            }
+        }
+        /* Unpaired surrogate */
+        text[c++] = 0xFFFD;
+        i += 2;
+    }
+    *used = i;
+    return c;
+}
+
+/*
+ * Decode the UTF-32 in "bytes[len]" into "text", like decode_utf16.
+ */
+static size_t decode_utf32(const unsigned char *bytes, size_t len,
+                           int swap, wchar_t *text, size_t room,
+                           size_t *used)
+{
+    unsigned int cp;
+    size_t i = 0, c = 0;
+
+    while (len - i >= 4 && c < room)
+    {
+        memcpy(&cp, bytes + i, 4);
+        if (swap)
+            cp = SWAPBYTE32(cp);
+        if (cp > 0x10FFFF || (cp & 0xFFFFF800) == 0xD800)
+            cp = 0xFFFD;
+        if (sizeof(wchar_t) == 2 && cp >= 0x10000)
+        {
+            if (room - c < 2)
+                break;
+            text[c++] = (wchar_t)(0xD800 + ((cp - 0x10000) >> 10));
+            text[c++] = (wchar_t)(0xDC00 + (cp & 0x3FF));
+        }
+        else
+        {
+            text[c++] = (wchar_t)cp;
+        }
+        i += 4;
+    }
+    *used = i;
+    return c;
+}
+
+/*
+ * Decode "bytes[len]" in the locale encoding, like decode_utf16.  As
+ * with getwc, an invalid sequence ends the input, which is reported by
+ * setting "*invalid".
+ */
+static size_t decode_locale(const unsigned char *bytes, size_t len,
+                            int final, wchar_t *text, size_t room,
+                            size_t *used, int *invalid)
+{
+    mbstate_t state;
+    size_t i = 0, c = 0, n;
+
+    memset(&state, 0, sizeof state);
+    while (c < room && i < len)
+    {
+        if (bytes[i] < 0x80 && mbsinit(&state))
+        {   /* ASCII, which needs no conversion in ASCII-based locales */
+            text[c++] = bytes[i++];
+            continue;
+        }
+        n = mbrtowc(text + c, (const char *)bytes + i, len - i, &state);
+        if (n == (size_t)-2 && !final)
+            break;
+        if (n == (size_t)-1 || n == (size_t)-2)
+        {
+            *invalid = 1;
+            break;
+        }
+        i += n ? n : 1;
+        ++c;
+    }
+    *used = i;
+    return c;
+}
+
+/*
+ * Read at most "max_chars" characters of input in UTF-16, UTF-32, or a
+ * CJK encoding into buffer, and return the number of characters.  The
+ * input is decoded a block at a time, without going through the
+ * locale.  Except on Windows, input in the locale encoding is decoded
+ * here too, which is much faster than getwc.
+ */
+static size_t load_encoded_text(FILE *fp_in, size_t max_chars)
+{
+    static unsigned char bytes[64*1024];
+    const unsigned short one = 1;
+    const int little_endian = *(const unsigned char *)&one;
+    int utf16 = encoding == ENC_UTF16LE || encoding == ENC_UTF16BE;
+    int le = encoding == ENC_UTF16LE || encoding == ENC_UTF32LE;
+    int swap = le != little_endian;
+    size_t len = 0, count, room, used, c = 0;
+    size_t skip = encoding <= ENC_LOCALE || encoding == ENC_CJK ||
+                  shard_begin ? 0 : utf16 ? 2 : 4;
+    unsigned long long left = shard_end ? shard_end - shard_begin :
+                                          (unsigned long long)-1;
+    long n;
+    int invalid = 0;
+
+    for (;;)
+    {
+        if (zinput)
+        {
+            n = zio_read(zinput, bytes + len, sizeof bytes - len);
+            count = n > 0 ? (size_t)n : 0;
+        }
+        else
+        {
+            room = sizeof bytes - len;
+            if (room > left)
+                room = (size_t)left;
+            count = fread(bytes + len, 1, room, fp_in);
+            left -= count;
+        }
+        len += count;
+        if (skip && (len >= skip || count == 0))
+        {   /* Skip the byte order mark */
+            if (len >= skip &&
+                    memcmp(bytes, utf16 ? (le ? "\xFF\xFE" : "\xFE\xFF")
+                                        : (le ? "\xFF\xFE\0\0"
+                                              : "\0\0\xFE\xFF"),
+                           skip) == 0)
+            {
+                memmove(bytes, bytes + skip, len - skip);
+                len -= skip;
+            }
+            skip = 0;
+        }
+        if (encoding == ENC_LOCALE)
+        {
+            c += decode_locale(bytes, len, count == 0, buffer + c,
+                               max_chars - c, &used, &invalid);
+        }
+        else if (encoding == ENC_CJK)
+        {
+            c += cjk_decode(cjk_codec, bytes, len, count == 0, buffer + c,
+                            max_chars - c, &used);
+        }
+        else if (utf16)
+        {
+            c += decode_utf16(bytes, len, swap, count == 0, buffer + c,
+                              max_chars - c, &used);
+        }
+        else
+        {
+            c += decode_utf32(bytes, len, swap, buffer + c, max_chars - c,
+                              &used);
+        }
+        memmove(bytes, bytes + used, len - used);
+        len -= used;
+        if (count == 0 || c == max_chars || invalid)
+            break;
+    }
+    if (encoding == ENC_LOCALE && c > 1 && buffer[0] == BOM &&
+            shard_begin == 0)
+    {
+        memmove(buffer, buffer + 1, (--c) * sizeof(wchar_t));
+    }
+    return c;
+}
+
+/*
+ * Open the input file, or stdin for "-".  On POSIX systems, compressed
+ * input is read through zinput, which decompresses it, and so is input
+ * that is not a regular file (or any input in filter mode), as its first
+ * bytes are consumed in detecting the format.  The file returned is then
+ * not read by stdio.
+ */
+static FILE *open_input(const char *filename)
+{
+    FILE *fp_in;
+#ifndef _WIN32
+    struct stat st;
+    unsigned char magic[4];
+    ssize_t count;
+#endif
+
+    if (strcmp(filename, "-") == 0)
+    {
+        fp_in = stdin;
+    }
+    else
+    {
+        if ( (fp_in = fopen(filename, "rb")) == NULL)
+        {
+            perror("Cannot open input file");
+            exit(1);
+        }
+    }
+
+#ifndef _WIN32
+    if (!filter && fstat(fileno(fp_in), &st) == 0 && S_ISREG(st.st_mode))
+    {
+        count = pread(fileno(fp_in), magic, sizeof magic, 0);
+        if (count <= 0 || zio_detect(magic, (size_t)count) == ZIO_NONE)
+            return fp_in;
+    }
+    if ( (zinput = zio_open_reader(fileno(fp_in))) == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (zio_error(zinput))
+    {
+        fprintf(stderr, "Cannot read input: %s\n", zio_error(zinput));
+        exit(1);
+    }
+#endif
+    return fp_in;
+}
+
+/* Exit if the input could not be decompressed */
+static void check_input(void)
+{
+    if (zinput && zio_error(zinput))
+    {
+        fprintf(stderr, "Cannot read input: %s\n", zio_error(zinput));
+        exit(1);
+    }
+}
+
+static FILE *open_output(int argc, char *argv[])
+{
+    FILE *fp_out;
+    struct zio *z;
+    const wchar_t bom = BOM;
+
+    if (optind + 1 < argc)
+    {
+        if ( (fp_out = fopen(argv[optind + 1], "wb")) == NULL)
+        {
+            perror("Cannot open output file");
+            exit(1);
+        }
+    }
+    else
+    {
+        fp_out = stdout;
+    }
+    if (compression != ZIO_NONE)
+    {
+        z = zio_open_writer(fp_out, compression, filter);
+        if (z == NULL || zio_error(z) || (fp_out = zio_fopen(z)) == NULL)
+        {
+            fprintf(stderr, "Cannot compress output\n");
+            exit(1);
+        }
+    }
+#ifndef _WIN32
+    /* The file sink converts whole lines faster than putwc */
+    fwide(fp_out, -1);
+#endif
+    if (optind + 1 < argc && !offset_unit && encoding != ENC_CJK &&
+            !metric_count && shard_begin == 0)
+    {
+        if (fwide(fp_out, 0) < 0)
+            put_mb_buffer(&bom, 0, 1, fp_out);
+        else
+            putwc(BOM, fp_out);
+    }
+    return fp_out;
+}
+
+static void close_files(FILE *fp_in, FILE *fp_out)
+{
+    if (fp_in != stdin)
+    {
+        fclose(fp_in);
+    }
+    if (fp_out != stdout && fclose(fp_out) != 0)
+    {
+        fprintf(stderr, "Cannot write output file\n");
+        exit(1);
+    }
+    if (trace_close() < 0)
+    {
+        fprintf(stderr, "Cannot write trace file\n");
+        exit(1);
+    }
+}
+
+static void print_settings(const char *loc)
+{
+    fprintf(stderr, "Locale:          %s\n", loc);
+    fprintf(stderr, "Ambiguous width: %s\n", ambw == 1 ?
+                                             "Single" : "Double");
+    fprintf(stderr, "Indentation:     %s\n", keep_indent ? "On" : "Off");
+    fprintf(stderr, "Line width:      %d\n", width);
+    if (encoding > ENC_LOCALE)
+        fprintf(stderr, "Encoding:        %s\n", encoding == ENC_CJK ?
+                                                 cjk_codec_name(cjk_codec) :
+                                                 encoding_names[encoding]);
+    if (zinput && zio_format(zinput) != ZIO_NONE)
+        fprintf(stderr, "Decompression:   %s\n",
+                zio_format_name(zio_format(zinput)));
+    if (compression != ZIO_NONE)
+        fprintf(stderr, "Compression:     %s\n",
+                zio_format_name(compression));
+}
+
+/* Counters at the start of each stage, and at the end */
+#define STAGES 4
+static struct perfcount counters;
+static unsigned long long stage_counts[STAGES + 1][PERFCOUNT_EVENTS];
+
+/*
+ * Record the time and, when hardware counters are reported (-vv), the
+ * counters at the start of "stage".
+ */
+static pctimer_t mark_stage(int stage)
+{
+    if (verbose > 1)
+        perfcount_read(&counters, stage_counts[stage]);
+    return pctimer();
+}
+
+static void print_counters(void)
+{
+    static const char *stage_names[STAGES] =
+    {
+        "Loading", "Breaks", "Widths", "Breaking"
+    };
+    unsigned long long *begin, *end;
+    int i, n;
+
+    fprintf(stderr, "%-16s", "Counters:");
+    for (n = 0; n < STAGES; ++n)
+        fprintf(stderr, " %14s", stage_names[n]);
+    fprintf(stderr, "\n");
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+    {
+        fprintf(stderr, "  %-14s", perfcount_names[i]);
+        for (n = 0; n < STAGES; ++n)
+        {
+            begin = stage_counts[n];
+            end = stage_counts[n + 1];
+            if (begin[i] == PERFCOUNT_NONE || end[i] == PERFCOUNT_NONE)
+                fprintf(stderr, " %14s", "n/a");
+            else
+                fprintf(stderr, " %14llu", end[i] - begin[i]);
+        }
+        fprintf(stderr, "\n");
+    }
+}
+
+static void print_cache_stats(void)
+{
+    unsigned long lookups = para_cache.hits + para_cache.misses;
+
+    if (!para_cache.capacity)
+        return;
+    fprintf(stderr, "Paragraph cache: %lu hits, %lu misses (%.1f%% hit)\n",
+            para_cache.hits, para_cache.misses,
+            lookups ? 100.0 * para_cache.hits / lookups : 0.0);
+}
+
+static void print_page_faults(void)
+{
+#ifndef _WIN32
+    struct rusage usage;
+
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        fprintf(stderr, "Page faults:     %ld minor, %ld major\n",
+                usage.ru_minflt, usage.ru_majflt);
+    }
+#endif
+}
+
+int main(int argc, char *argv[])
+{
+    FILE *fp_in;
+    FILE *fp_out;
+    size_t c;
+    const char opts[] = "L:l:w:ih:H:x:r:b:m:e:z:j:c:p:s:T:ft:v";
+    char opt;
+    const char *loc;
+    const char *hyphen_file = NULL;
+    const char *index_file = NULL;
+    const char *trace_file = NULL;
+    wchar_t *text;
+    unsigned char *text_brks;
+    unsigned char *text_widths;
+    size_t max_chars;
+    unsigned long long hash = 0;
+    const char *index_status = NULL;
+    unsigned long first_line = 0;
+    unsigned long last_line = 0;
+    unsigned long cache_size = 0;
+    int shard_count = 0;
+    struct text_metrics metrics;
+    char *end;
+    struct file_sink out;
+    struct cjk_sink cjk_out;
+    struct offset_sink offsets;
+    struct line_sink *sink;
+    struct viewport vp;
+    pctimer_t t1, t2, t3, t4, t5;
+    int i, n;
+
+    if (argc == 1)
     {
         usage();
         exit(1);
@@ -722,6 +3787,141 @@ int main(int argc, char *argv[])
         case 'i':
             ++keep_indent;
             break;
+        case 'h':
+            if ( (hyphen_trie = hyphen_load(optarg)) == NULL)
+            {
+                if (errno == EINVAL)
+                    fprintf(stderr, "Invalid hyphenation file: %s\n",
+                            optarg);
+                else
+                    perror("Cannot load hyphenation file");
+                exit(1);
+            }
+            break;
+        case 'H':
+            hyphen_file = optarg;
+            break;
+        case 'x':
+            index_file = optarg;
+            break;
+        case 'r':
+            first_line = strtoul(optarg, &end, 10);
+            if (*end == ',')
+                last_line = strtoul(end + 1, &end, 10);
+            if (first_line == 0 || *end != '\0' ||
+                    (last_line != 0 && last_line < first_line))
+            {
+                fprintf(stderr, "Invalid line range\n");
+                exit(1);
+            }
+            break;
+        case 'm':
+            end = optarg;
+            do
+            {
+                if (metric_count == MAXMETRICS)
+                {
+                    fprintf(stderr, "Too many widths\n");
+                    exit(1);
+                }
+                metric_widths[metric_count] = (int)strtol(end, &end, 10);
+                if (metric_widths[metric_count++] < 2 ||
+                        (*end != ',' && *end != '\0'))
+                {
+                    fprintf(stderr, "Invalid width\n");
+                    exit(1);
+                }
+            } while (*end++ == ',');
+            break;
+        case 'e':
+            for (encoding = ENC_UTF16LE; encoding <= ENC_UTF32BE; ++encoding)
+            {
+                if (strcmp(optarg, encoding_names[encoding]) == 0)
+                    break;
+            }
+            if (encoding > ENC_UTF32BE)
+            {
+                if ( (cjk_codec = cjk_find_codec(optarg)) == NULL)
+                {
+                    fprintf(stderr, "Invalid encoding\n");
+                    exit(1);
+                }
+                if (cjk_init_encoder(cjk_codec) < 0)
+                {
+                    fprintf(stderr, "Out of memory\n");
+                    exit(1);
+                }
+                encoding = ENC_CJK;
+            }
+            break;
+        case 'b':
+            if (strcmp(optarg, "b") == 0)
+                offset_unit = 1;
+            else if (strcmp(optarg, "c") == 0)
+                offset_unit = sizeof(wchar_t);
+            else if (strcmp(optarg, "u") == 0)
+                offset_unit = OFFSET_INPUT;
+            else
+            {
+                fprintf(stderr, "Invalid offset unit\n");
+                exit(1);
+            }
+            break;
+        case 'z':
+            if ( (compression = zio_find_format(optarg)) < 0)
+            {
+                fprintf(stderr, "Unsupported compression format\n");
+                exit(1);
+            }
+            break;
+        case 'j':
+            threads = atoi(optarg);
+            if (threads < 1)
+            {
+                fprintf(stderr, "Invalid number of threads\n");
+                exit(1);
+            }
+            break;
+        case 'c':
+            cache_size = strtoul(optarg, &end, 10);
+            if (cache_size == 0 || *end != '\0')
+            {
+                fprintf(stderr, "Invalid cache size\n");
+                exit(1);
+            }
+            break;
+        case 'p':
+            shard_count = atoi(optarg);
+            if (shard_count < 1)
+            {
+                fprintf(stderr, "Invalid number of shards\n");
+                exit(1);
+            }
+            break;
+        case 's':
+            shard_begin = strtoull(optarg, &end, 10);
+            if (*end == ',')
+                shard_end = strtoull(end + 1, &end, 10);
+            if (*end != '\0' || shard_begin > shard_end)
+            {
+                fprintf(stderr, "Invalid shard\n");
+                exit(1);
+            }
+            break;
+        case 'T':
+            trace_file = optarg;
+            break;
+        case 'f':
+            ++filter;
+            break;
+        case 't':
+            timeout = atoi(optarg);
+            if (timeout < 0)
+            {
+                fprintf(stderr, "Invalid timeout\n");
+                exit(1);
+            }
+            break;
         case 'v':
             ++verbose;
             break;
@@ -739,103 +3939,326 @@ int main(int argc, char *argv[])
 
     loc = setlocale(LC_ALL, locale);
 
-    t1 = pctimer();
+    if (lang && (strncmp(lang, "zh", 2) == 0 ||
+                 strncmp(lang, "ja", 2) == 0 ||
+                 strncmp(lang, "ko", 2) == 0))
+    {
+        ambw = 2;
+    }
 
-    if (strcmp(argv[optind], "-") == 0)
+    if (sizeof(wchar_t) != 2 && sizeof(wchar_t) != 4)
     {
-        fp_in = stdin;
+        fprintf(stderr, "Unexpected wchar_t size!\n");
+        exit(1);
     }
-    else
+    init_linebreak();
+    init_widths();
+
+    if (verbose > 1 && perfcount_open(&counters) == 0)
+    {
+        fprintf(stderr, "Hardware counters are not available\n");
+    }
+    if (trace_file)
     {
-        if ( (fp_in = fopen(argv[optind], "rb")) == NULL)
+        if (trace_open(trace_file) < 0)
         {
-            perror("Cannot open input file");
+            perror("Cannot open trace file");
             exit(1);
         }
+        trace_thread_name(0, "Main");
     }
 
-    for (c = 0; c < MAXCHARS; ++c)
+    t1 = mark_stage(0);
+
+    if (filter && offset_unit)
     {
-        wch = getwc(fp_in);
-        if (wch == WEOF)
-            break;
-        buffer[c] = wch;
+        fprintf(stderr, "Break offsets cannot be output in filter mode\n");
+        exit(1);
+    }
+    if (filter && encoding != ENC_AUTO)
+    {
+        fprintf(stderr, "The encoding cannot be set in filter mode\n");
+        exit(1);
     }
 
-    if (buffer[0] == SWAPBYTE(BOM))
+    if (metric_count && (filter || first_line || offset_unit || cache_size))
     {
-        fprintf(stderr, "Wrong endianness of input\n");
+        fprintf(stderr, "Metrics cannot be output with -f, -r, -b, or -c\n");
         exit(1);
     }
-    if (buffer[0] == BOM && c > 1)
+    /* The text is analysed for the smallest width */
+    for (i = 0; i < metric_count; ++i)
     {
-        memmove(buffer, buffer + 1, (--c) * sizeof(wchar_t));
+        if (i == 0 || width > metric_widths[i])
+            width = metric_widths[i];
+    }
+    if (cache_size && (index_file || first_line || threads > 1))
+    {
+        fprintf(stderr, "The paragraph cache cannot be used with an index, "
+                        "a line range, or threads\n");
+        exit(1);
+    }
+    if (cache_size && para_cache_init(&para_cache, cache_size) < 0)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if ((shard_count || shard_end) && (filter || index_file || first_line ||
+                                       offset_unit || metric_count ||
+                                       hyphen_file))
+    {
+        fprintf(stderr, "Shards cannot be used with -f, -x, -r, -b, -m, "
+                        "or -H\n");
+        exit(1);
+    }
+#ifdef _WIN32
+    if (shard_count || shard_end)
+    {
+        fprintf(stderr, "Shards are not supported on Windows\n");
+        exit(1);
     }
+#endif
 
-    t2 = pctimer();
+    fp_in = open_input(argv[optind]);
 
-    init_linebreak();
-    if (sizeof(wchar_t) == 2)
+#ifndef _WIN32
+    if (shard_count || shard_end)
     {
-        set_linebreaks_utf16((utf16_t*)buffer, c, lang, brks);
+        /* Compressed input and pipes are read through zinput */
+        if (zinput)
+        {
+            fprintf(stderr, "Shards need an uncompressed input file\n");
+            exit(1);
+        }
+        if (encoding == ENC_AUTO)
+            encoding = detect_encoding(fp_in);
     }
-    else if (sizeof(wchar_t) == 4)
+    if (shard_count)
     {
-        set_linebreaks_utf32((utf32_t*)buffer, c, lang, brks);
+        if (optind + 1 < argc)
+        {
+            if ( (fp_out = fopen(argv[optind + 1], "w")) == NULL)
+            {
+                perror("Cannot open output file");
+                exit(1);
+            }
+        }
+        else
+        {
+            fp_out = stdout;
+        }
+        plan_shards(fp_in, shard_count, fp_out);
+        close_files(fp_in, fp_out);
+        return 0;
     }
-    else
+    if (shard_end && fseeko(fp_in, (off_t)shard_begin, SEEK_SET) != 0)
     {
-        fprintf(stderr, "Unexpected wchar_t size!\n");
+        perror("Cannot seek input file");
         exit(1);
     }
+#endif
 
-    t3 = pctimer();
+    /* The analysis is kept for other uses only with an index or a range */
+    short_lines = !index_file && !first_line;
 
-    if (lang && (strncmp(lang, "zh", 2) == 0 ||
-                 strncmp(lang, "ja", 2) == 0 ||
-                 strncmp(lang, "ko", 2) == 0))
+    if (filter)
     {
-        ambw = 2;
+        alloc_buffers(MAXCHARS, 0);
+        fp_out = open_output(argc, argv);
+        filter_text(fp_in, fp_out);
+        check_input();
+        if (verbose)
+        {
+            print_settings(loc);
+            print_cache_stats();
+            print_page_faults();
+            fprintf(stderr, "Latencies:\n");
+            for (n = 0; n <= MAXLATENCY; ++n)
+            {
+                if (latencies[n])
+                {
+                    fprintf(stderr, "  %s%8lu us: %lu\n",
+                            n < MAXLATENCY ? "< " : ">=",
+                            1UL << (n < MAXLATENCY ? n : n - 1),
+                            latencies[n]);
+                }
+            }
+        }
+        close_files(fp_in, fp_out);
+        return 0;
     }
 
-    if (optind + 1 < argc)
+    /* The index depends on how the input is decoded */
+    if (encoding == ENC_AUTO)
+        encoding = detect_encoding(fp_in);
+
+    if (index_file && !hyphen_file)
     {
-        if ( (fp_out = fopen(argv[optind + 1], "wb")) == NULL)
+        if (strcmp(argv[optind], "-") == 0)
         {
-            perror("Cannot open output file");
+            fprintf(stderr, "An index cannot be used with stdin\n");
             exit(1);
         }
-        putwc(BOM, fp_out);
+        hash = hash_file(argv[optind]);
+        c = load_index(index_file, hash, &text, &text_brks, &text_widths);
+        if (c != (size_t)-1)
+        {
+            index_status = "Loaded";
+            t2 = mark_stage(1);
+            t3 = mark_stage(2);
+            t4 = mark_stage(3);
+            goto output;
+        }
     }
+
+    /* The size of compressed input does not limit the characters */
+    max_chars = zinput ? 0 : max_input_chars(fp_in);
+    alloc_buffers(max_chars ? max_chars : MAXCHARS, max_chars != 0);
+    if (max_chars == 0)
+        max_chars = MAXCHARS;
+#ifdef _WIN32
+    if (encoding == ENC_LOCALE)
+        c = load_text(fp_in, max_chars);
     else
+#endif
+        c = load_encoded_text(fp_in, max_chars);
+    check_input();
+    text = buffer;
+    text_brks = brks;
+    text_widths = widths;
+
+    if (hyphen_file)
     {
-        fp_out = stdout;
+        if (hyphen_compile(buffer, c, hyphen_file) < 0)
+        {
+            perror("Cannot write hyphenation file");
+            exit(1);
+        }
+        close_files(fp_in, stdout);
+        return 0;
     }
 
-    break_text(buffer, brks, c, fp_out);
+    t2 = mark_stage(1);
 
-    t4 = pctimer();
+    /* With the cache, the breaks and widths are found with the lines */
+    if (!para_cache.capacity)
+        find_breaks(buffer, c, lang, brks);
 
-    if (verbose)
+    t3 = mark_stage(2);
+
+    if (!para_cache.capacity)
+        set_widths(buffer, c, widths);
+
+    if (index_file)
     {
-        fprintf(stderr, "Locale:          %s\n", loc);
-        fprintf(stderr, "Ambiguous width: %s\n", ambw == 1 ?
-                                                 "Single" : "Double");
-        fprintf(stderr, "Indentation:     %s\n", keep_indent ? "On" : "Off");
-        fprintf(stderr, "Line width:      %d\n", width);
-        fprintf(stderr, "Loading file:    %f s\n", t2 - t1);
-        fprintf(stderr, "Finding breaks:  %f s\n", t3 - t2);
-        fprintf(stderr, "Breaking text:   %f s\n", t4 - t3);
-        fprintf(stderr, "TOTAL:           %f s\n", t4 - t1);
+        if (save_index(index_file, hash, buffer, brks, widths, c) < 0)
+        {
+            perror("Cannot write index file");
+            index_status = "Not written";
+        }
+        else
+        {
+            index_status = "Written";
+        }
     }
 
-    if (fp_in != stdin)
+    t4 = mark_stage(3);
+
+output:
+    fp_out = open_output(argc, argv);
+    if (offset_unit)
     {
-        fclose(fp_in);
+        if (offset_unit == OFFSET_INPUT)
+            offset_unit = input_unit(fp_in);
+        init_offset_sink(&offsets, fp_out);
+        sink = &offsets.sink;
+    }
+    else if (encoding == ENC_CJK)
+    {
+        cjk_out.sink.put_line = cjk_put_line;
+        cjk_out.fp = fp_out;
+        sink = &cjk_out.sink;
+    }
+    else
+    {
+        init_file_sink(&out, fp_out);
+        sink = &out.sink;
+    }
+    if (metric_count)
+    {
+        fprintf(fp_out, "width\tlines\tmax_width\tforced_cuts\t"
+                        "longest_segment\n");
+        n = longest_segment(text, text_brks, text_widths, c, lang);
+        for (i = 0; i < metric_count; ++i)
+        {
+            width = metric_widths[i];
+            measure_text(text, text_brks, text_widths, c, &metrics);
+            fprintf(fp_out, "%d\t%lu\t%d\t%lu\t%d\n", width,
+                    (unsigned long)metrics.lines, metrics.max_width,
+                    (unsigned long)metrics.forced_cuts, n);
+        }
+    }
+    else if (first_line)
+    {
+        if (viewport_init(&vp, text, text_brks, text_widths, c) < 0)
+        {
+            fprintf(stderr, "Out of memory\n");
+            exit(1);
+        }
+        viewport_output(&vp, first_line - 1,
+                        last_line ? last_line - first_line + 1 : (size_t)-1,
+                        sink);
+        viewport_free(&vp);
+    }
+    else if (para_cache.capacity)
+    {
+        break_paragraphs(text, text_brks, text_widths, c, lang, &para_cache,
+                         sink);
+    }
+    else if (threads > 1)
+    {
+        break_text_parallel(text, text_brks, text_widths, 0, c, sink,
+                            threads);
+    }
+    else
+    {
+        break_text(text, text_brks, text_widths, 0, c, sink);
     }
-    if (fp_out != stdout)
+
+    t5 = mark_stage(4);
+
+    trace_span("Loading", 0, t1, t2, "\"chars\": %lu", (unsigned long)c);
+    trace_span("Finding breaks", 0, t2, t3, "\"chars\": %lu",
+               (unsigned long)c);
+    trace_span("Finding widths", 0, t3, t4, "\"chars\": %lu",
+               (unsigned long)c);
+    trace_span("Breaking", 0, t4, t5, "\"chars\": %lu, \"threads\": %d",
+               (unsigned long)c, first_line ? 1 : threads);
+
+    if (verbose)
     {
-        fclose(fp_out);
+        print_settings(loc);
+        if (index_status)
+            fprintf(stderr, "Index:           %s\n", index_status);
+        fprintf(stderr, "Loading file:    %f s\n", t2 - t1);
+        fprintf(stderr, "Finding breaks:  %f s\n", t3 - t2);
+        fprintf(stderr, "Finding widths:  %f s\n", t4 - t3);
+        fprintf(stderr, "Breaking text:   %f s\n", t5 - t4);
+        fprintf(stderr, "TOTAL:           %f s\n", t5 - t1);
+        if (chunks_accepted + chunks_recomputed)
+            fprintf(stderr, "Parallel parts:  %lu accepted, %lu recomputed\n",
+                    chunks_accepted, chunks_recomputed);
+        print_cache_stats();
+        print_page_faults();
+        if (verbose > 1)
+        {
+            print_counters();
+            perfcount_close(&counters);
+        }
     }
+
+    close_files(fp_in, fp_out);
     return 0;
 }
+
+#endif /* BREAKTEXT_NO_MAIN */
@@ -0,0 +1,279 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * breaktext.h: interface of the text breaking functions in breaktext.c
+ *
+ * To use them in another program, compile breaktext.c with
+ * BREAKTEXT_NO_MAIN defined.  The options are the global variables
+ * below.
+ */
+
+#ifndef BREAKTEXT_H
+#define BREAKTEXT_H
+
+#include <stddef.h>
+#include <stdio.h>
+#include <wchar.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+struct hyphen_trie;
+struct batch_part;
+
+/* Breaking opportunities are stored with 2 bits per character */
+#define BRKS_SIZE(len)      (((len) + 3) / 4)
+#define GET_BRK(brks, i)    (((brks)[(i) / 4] >> ((i) % 4 * 2)) & 3)
+#define SET_BRK(brks, i, v) \
+    ((brks)[(i) / 4] = (unsigned char)(((brks)[(i) / 4] & \
+                                        ~(3 << ((i) % 4 * 2))) | \
+                                       ((v) << ((i) % 4 * 2))))
+
+extern int ambw;
+extern int width;
+extern int keep_indent;
+/* Nonzero to pass lines that certainly fit (printable ASCII no longer
+ * than the width) through find_breaks, set_widths, and break_text
+ * without analysis; brks and widths are then not set for them, so they
+ * cannot be reused with another width */
+extern int short_lines;
+
+/* An output line: "indent" spaces, buffer[begin..end), and a hyphen if
+ * "hyphen" is nonzero.  "hard" is nonzero if the line ends at a
+ * mandatory break, which is buffer[end]. */
+struct line
+{
+    size_t begin;
+    size_t end;
+    int indent;
+    int hyphen;
+    int hard;
+};
+
+/* Receiver of the lines from break_text.  put_line returns nonzero to
+ * stop breaking. */
+struct line_sink
+{
+    int (*put_line)(struct line_sink *sink, const wchar_t *buffer,
+                    const struct line *line);
+};
+
+/*
+ * State of breaking a text into lines on demand.  The options are copied
+ * from the globals by line_iter_init, and nothing is allocated, so one
+ * may stop calling line_iter_next at any time.
+ */
+struct line_iter
+{
+    const wchar_t *buffer;
+    unsigned char *brks;
+    const unsigned char *widths;
+    size_t begin;
+    size_t len;
+    int width;
+    int keep_indent;
+    int short_lines;
+    const struct hyphen_trie *hyphen_trie;
+    size_t pos;                 /* Next character to lay out */
+    size_t last_break_pos;
+    size_t last_breakable_pos;
+    int col;
+    int indent;
+    int line_indent;
+    int is_at_beginning;
+    int tail_col;
+    int tail_unsure;
+    int resume;                 /* Nonzero if buffer[pos] is half done */
+    int hard_start;             /* Nonzero after a mandatory break */
+    /* Characters laid out and looked at for hyphenation, and the work
+     * allowed beyond MAXPASSES per character (in debug builds) */
+    size_t work;
+    size_t allowance;
+};
+
+/* A sink that writes the lines to a file */
+struct file_sink
+{
+    struct line_sink sink;
+    FILE *fp;
+};
+
+/* Lazily built map from output lines to the text, for showing parts of
+ * the output of a large text */
+struct viewport
+{
+    const wchar_t *buffer;
+    unsigned char *brks;
+    const unsigned char *widths;
+    size_t len;
+    size_t *positions;          /* Paragraph starts of the checkpoints */
+    size_t *lines;              /* Output lines before the checkpoints */
+    size_t count;
+    size_t capacity;
+};
+
+void init_widths(void);
+/* Display width of character "c" (0, 1, or 2), from the cache that
+ * init_widths resets; the cache is filled on use, so the calls should
+ * not be made from several threads at once */
+int char_width(unsigned int c);
+void set_widths(const wchar_t *buffer, size_t len, unsigned char *widths);
+void find_breaks(const wchar_t *buffer, size_t len, const char *lang,
+                 unsigned char *brks);
+
+void init_file_sink(struct file_sink *sink, FILE *fp);
+
+/*
+ * Break buffer[begin..len) into lines, and pass them to "sink".  "begin"
+ * must be the start of a paragraph.  Returns nonzero if the sink stopped
+ * breaking.
+ */
+int break_text(const wchar_t *buffer, unsigned char *brks,
+               const unsigned char *widths, size_t begin, size_t len,
+               struct line_sink *sink);
+
+/*
+ * Prepare to break buffer[begin..len) into lines like break_text, but one
+ * line per call of line_iter_next, which returns 1 and fills "line", or 0
+ * at the end of the text.  The text is only laid out as far as the lines
+ * are pulled.  "brks" may be changed as in break_text.
+ */
+void line_iter_init(struct line_iter *it, const wchar_t *buffer,
+                    unsigned char *brks, const unsigned char *widths,
+                    size_t begin, size_t len);
+int line_iter_next(struct line_iter *it, struct line *line);
+
+/*
+ * Like break_text, but lay out the text with up to "threads" threads.
+ * The output is the same.  The numbers of parts of the text whose
+ * speculative layout was accepted (after the lines met) or had to be
+ * recomputed in full are added to chunks_accepted and chunks_recomputed.
+ */
+int break_text_parallel(const wchar_t *buffer, unsigned char *brks,
+                        const unsigned char *widths, size_t begin,
+                        size_t len, struct line_sink *sink, int threads);
+
+extern unsigned long chunks_accepted;
+extern unsigned long chunks_recomputed;
+
+/*
+ * Lines of a batch of strings, as arrays of their fields.  The lines of
+ * string k are first[k]..first[k + 1]-1, and line j is "indent[j]"
+ * spaces, string[begin[j]..end[j]), and a hyphen if "hyphen[j]" is
+ * nonzero.
+ */
+struct batch_lines
+{
+    size_t *first;              /* One more than the strings */
+    size_t *begin;
+    size_t *end;
+    int *indent;
+    unsigned char *hyphen;
+    size_t count;
+    size_t capacity;
+    size_t string_capacity;
+};
+
+/* Result of break_batch, and the buffers kept for the next batch */
+struct text_batch
+{
+    struct batch_lines lines;
+    struct batch_part *parts;
+    int part_count;
+};
+
+void text_batch_init(struct text_batch *batch);
+void text_batch_free(struct text_batch *batch);
+
+/*
+ * Break each of the "count" strings (of "lengths" characters) as a
+ * paragraph, and put the lines in batch->lines.  The strings are copied
+ * into one buffer, so that they are analysed with a few calls of
+ * libunibreak instead of one each.  Batches large enough are divided
+ * among up to "threads" threads.  Returns -1 if out of memory.
+ */
+int break_batch(struct text_batch *batch, const wchar_t *const *strings,
+                const size_t *lengths, size_t count, const char *lang,
+                int threads);
+
+/*
+ * Bounded cache of the lines of paragraphs, looked up by the text of a
+ * paragraph and the options.  The least recently used paragraph is
+ * dropped to make room.
+ */
+struct para_cache
+{
+    struct para_entry **buckets;
+    size_t mask;
+    struct para_entry *newest;
+    struct para_entry *oldest;
+    size_t count;
+    size_t capacity;
+    struct line *lines;         /* Lines of the paragraph being broken */
+    size_t line_count;
+    size_t line_capacity;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+int para_cache_init(struct para_cache *cache, size_t capacity);
+void para_cache_free(struct para_cache *cache);
+
+/*
+ * Break buffer[0..len) into lines like find_breaks, set_widths, and
+ * break_text, but a paragraph at a time, so that the lines of a
+ * paragraph found in "cache" are passed to "sink" without finding its
+ * breaks, widths, or lines again.  Returns nonzero if the sink stopped
+ * breaking.
+ */
+int break_paragraphs(const wchar_t *buffer, unsigned char *brks,
+                     unsigned char *widths, size_t len, const char *lang,
+                     struct para_cache *cache, struct line_sink *sink);
+
+/* Sizes of the output of a text, without the output */
+struct text_metrics
+{
+    size_t lines;
+    int max_width;              /* Of the widest line, without trailing
+                                   spaces */
+    size_t forced_cuts;         /* Lines cut where no break is allowed */
+};
+
+/*
+ * Lay out buffer[0..len) at the current width, and find the metrics of
+ * the lines.  If short_lines was set in the analysis, the width must not
+ * be smaller than then.
+ */
+void measure_text(const wchar_t *buffer, unsigned char *brks,
+                  const unsigned char *widths, size_t len,
+                  struct text_metrics *metrics);
+
+/*
+ * Width of the longest part of buffer[0..len) that cannot be broken,
+ * which does not depend on the width.  If short_lines was set in the
+ * analysis, the width must be the same, and the breaks of some short
+ * lines are found now.
+ */
+int longest_segment(const wchar_t *buffer, unsigned char *brks,
+                    const unsigned char *widths, size_t len,
+                    const char *lang);
+
+int viewport_init(struct viewport *vp, const wchar_t *buffer,
+                  unsigned char *brks, const unsigned char *widths,
+                  size_t len);
+void viewport_free(struct viewport *vp);
+
+/*
+ * Pass output lines first..first+count-1 (counting from 0) to "sink".
+ * Returns the number of lines passed, which is less than "count" at the
+ * end of the text.
+ */
+size_t viewport_output(struct viewport *vp, size_t first, size_t count,
+                       struct line_sink *sink);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BREAKTEXT_H */
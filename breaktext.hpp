@@ -0,0 +1,419 @@
+// vim: set et sts=4 sw=4:
+
+/*
+ * breaktext.hpp: header-only C++ interface for breaking UTF-8, UTF-16,
+ * and UTF-32 strings in place
+ *
+ * The lines are views into the string passed in, which is analysed with
+ * the set_linebreaks_utf* function of its encoding, and laid out a code
+ * unit at a time by the same rules as break_text in breaktext.c; the
+ * text is never converted to wchar_t.  Hyphenation is not supported
+ * here.  C++17 is needed (C++20 for char8_t), and the program must be
+ * linked with breaktext.c, compiled with BREAKTEXT_NO_MAIN, for the
+ * character widths, and libunibreak; init_linebreak and init_widths must
+ * have been called.
+ *
+ *     breaktext::line_iterator<char16_t> it(text, 40);
+ *     breaktext::line_view<char16_t> line;
+ *     while (it.next(line))
+ *         ...
+ */
+
+#ifndef BREAKTEXT_HPP
+#define BREAKTEXT_HPP
+
+#include <stddef.h>
+#include <string_view>
+#include <vector>
+#include "linebreak.h"
+#include "breaktext.h"
+
+namespace breaktext {
+
+/*
+ * Encoding of the code units of type CharT: how to analyse a string,
+ * decode a character, and step back over one.  ASCII is recognized from
+ * a single code unit in all of them, so that the rules of the layout for
+ * spaces, "C++", and '/' need no decoding.
+ */
+template <typename CharT>
+struct unit_traits;
+
+struct utf8_traits
+{
+    static void set_linebreaks(const void *s, size_t len, const char *lang,
+                               char *brks)
+    {
+        set_linebreaks_utf8(static_cast<const utf8_t *>(s), len, lang,
+                            brks);
+    }
+
+    template <typename CharT>
+    static char32_t decode(const CharT *s, size_t len, size_t &i)
+    {
+        unsigned int c = static_cast<unsigned char>(s[i++]);
+        int n;
+
+        if (c < 0x80)
+            return c;
+        if (c >= 0xF0)
+        {
+            c &= 0x07;
+            n = 3;
+        }
+        else if (c >= 0xE0)
+        {
+            c &= 0x0F;
+            n = 2;
+        }
+        else
+        {
+            c &= 0x1F;
+            n = 1;
+        }
+        for (; n > 0 && i < len && is_trail(s[i]); --n)
+            c = c << 6 | (static_cast<unsigned char>(s[i++]) & 0x3F);
+        return c;
+    }
+
+    template <typename CharT>
+    static bool is_trail(CharT c)
+    {
+        return (static_cast<unsigned char>(c) & 0xC0) == 0x80;
+    }
+};
+
+template <>
+struct unit_traits<char> : utf8_traits
+{
+};
+
+#ifdef __cpp_char8_t
+template <>
+struct unit_traits<char8_t> : utf8_traits
+{
+};
+#endif
+
+template <>
+struct unit_traits<char16_t>
+{
+    static void set_linebreaks(const char16_t *s, size_t len,
+                               const char *lang, char *brks)
+    {
+        set_linebreaks_utf16(reinterpret_cast<const utf16_t *>(s), len,
+                             lang, brks);
+    }
+
+    static char32_t decode(const char16_t *s, size_t len, size_t &i)
+    {
+        char32_t c = s[i++];
+
+        if (c >= 0xD800 && c < 0xDC00 && i < len && is_trail(s[i]))
+            c = 0x10000 + ((c - 0xD800) << 10) + (s[i++] - 0xDC00);
+        return c;
+    }
+
+    static bool is_trail(char16_t c)
+    {
+        return c >= 0xDC00 && c < 0xE000;
+    }
+};
+
+template <>
+struct unit_traits<char32_t>
+{
+    static void set_linebreaks(const char32_t *s, size_t len,
+                               const char *lang, char *brks)
+    {
+        set_linebreaks_utf32(reinterpret_cast<const utf32_t *>(s), len,
+                             lang, brks);
+    }
+
+    static char32_t decode(const char32_t *s, size_t, size_t &i)
+    {
+        return s[i++];
+    }
+
+    static bool is_trail(char32_t)
+    {
+        return false;
+    }
+};
+
+/* A line: "indent" spaces, "text", and a hyphen if "hyphen" is set */
+template <typename CharT>
+struct line_view
+{
+    std::basic_string_view<CharT> text;
+    int indent;
+    bool hyphen;
+    bool hard;                  // Ends at a mandatory break (not in text)
+                                // or at the end of the text
+};
+
+/*
+ * Breaks a string into lines on demand, like line_iter in breaktext.h.
+ * The breaking opportunities are found when it is constructed, and the
+ * string must outlive it.
+ */
+template <typename CharT>
+class line_iterator
+{
+public:
+    typedef unit_traits<CharT> traits;
+
+    line_iterator(std::basic_string_view<CharT> text, int width,
+                  bool keep_indent = false, const char *lang = nullptr)
+        : text_(text), brks_(text.size()), width_(width),
+          keep_indent_(keep_indent)
+    {
+        if (!text.empty())
+            traits::set_linebreaks(text.data(), text.size(), lang,
+                                   brks_.data());
+    }
+
+    /* Find the next line.  Returns false at the end of the text. */
+    bool next(line_view<CharT> &line);
+
+private:
+    /* Whether "ch" causes a mandatory break (BK, CR, LF, and NL) */
+    static bool is_newline(char32_t ch)
+    {
+        return (ch >= 0x0A && ch <= 0x0D) || ch == 0x85 ||
+               ch == 0x2028 || ch == 0x2029;
+    }
+
+    /*
+     * Start of the character "n" characters before "pos", or npos if
+     * there are fewer before it
+     */
+    size_t back(size_t pos, int n) const
+    {
+        for (; n > 0; --n)
+        {
+            if (pos == 0)
+                return npos;
+            while (--pos > 0 && traits::is_trail(text_[pos]))
+                ;
+        }
+        return pos;
+    }
+
+    void put(line_view<CharT> &line, size_t end, bool hyphen, bool hard)
+    {
+        line.text = text_.substr(last_break_pos_, end - last_break_pos_);
+        line.indent = line_indent_;
+        line.hyphen = hyphen;
+        line.hard = hard;
+    }
+
+    static const size_t npos = static_cast<size_t>(-1);
+
+    std::basic_string_view<CharT> text_;
+    std::vector<char> brks_;    // Of the last code unit of each character
+    int width_;
+    bool keep_indent_;
+    size_t pos_ = 0;
+    size_t last_break_pos_ = 0;
+    size_t last_breakable_pos_ = 0;
+    int col_ = 0;
+    int indent_ = 0;
+    int line_indent_ = 0;
+    bool is_at_beginning_ = true;
+    int tail_col_ = 0;
+    int tail_unsure_ = 0;
+    bool resume_ = false;
+};
+
+template <typename CharT>
+bool line_iterator<CharT>::next(line_view<CharT> &line)
+{
+    const CharT *buffer = text_.data();
+    const size_t len = text_.size();
+    const bool long_line = width_ > 40;
+    size_t i = pos_;
+    size_t next;
+    char32_t ch;
+    int brk;
+    int w;
+
+    while (i < len)
+    {
+        next = i;
+        ch = traits::decode(buffer, len, next);
+        brk = brks_[next - 1];
+        // The last character always gets a mandatory break, but it is
+        // part of the text unless it causes one
+        if (next == len && brk == LINEBREAK_MUSTBREAK && !is_newline(ch))
+            brk = LINEBREAK_NOBREAK;
+        w = ch < 0x80 ? 1 : char_width(ch);
+        if (resume_)
+        {   // Finish the character after which the last line was broken
+            resume_ = false;
+            goto check_breakable;
+        }
+
+        if (brk == LINEBREAK_MUSTBREAK)
+        {
+            // The character causing the explicit break is not output
+            put(line, i, false, true);
+            pos_ = last_break_pos_ = last_breakable_pos_ = next;
+            col_ = 0;
+            indent_ = 0;
+            line_indent_ = 0;
+            is_at_beginning_ = true;
+            tail_col_ = 0;
+            tail_unsure_ = 0;
+            return true;
+        }
+
+        // Special processing for space-based indentation
+        if (is_at_beginning_)
+        {
+            if (ch == ' ')
+            {
+                // Reset indentation if it becomes unreasonable
+                if (++indent_ >= width_ / 2)
+                {
+                    indent_ = 0;
+                    is_at_beginning_ = false;
+                }
+            }
+            else
+            {
+                is_at_beginning_ = false;
+            }
+        }
+
+        // Special processing for "C++": no break.
+        if (ch == 'C' && brk == LINEBREAK_ALLOWBREAK &&
+                (i + 2 < len && buffer[i + 1] == '+' && buffer[i + 2] == '+') &&
+                ((i + 3 < len && buffer[i + 3] == ' ') ||
+                 brks_[i + 2] < LINEBREAK_NOBREAK) &&
+                (i == 0 || brks_[i - 1] < LINEBREAK_NOBREAK))
+        {
+            brks_[i] = LINEBREAK_NOBREAK;
+            brks_[i + 1] = LINEBREAK_NOBREAK;
+            continue;
+        }
+
+        // Right-margin spaces do not count
+        if (ch == ' ' && col_ == width_)
+        {
+            // But it will count on a new line
+            ++tail_unsure_;
+        }
+        else
+        {
+            col_ += w;
+            tail_col_ += w;
+        }
+
+        // Right margin crossed
+        if (col_ > width_)
+        {
+            // No breakable character since the last break
+            if (last_breakable_pos_ == last_break_pos_)
+            {
+                last_breakable_pos_ = i;
+                tail_col_ = w;
+                tail_unsure_ = 0;
+            }
+
+            put(line, last_breakable_pos_, false, false);
+            if (keep_indent_)
+            {
+                line_indent_ = indent_;
+                col_ = indent_;
+            }
+            else
+            {
+                line_indent_ = 0;
+                col_ = 0;
+            }
+            last_break_pos_ = last_breakable_pos_;
+
+            // Lay out the characters after the break again only if the
+            // new column could change how they are treated
+            if (tail_unsure_ || col_ + tail_col_ > width_)
+            {
+                pos_ = last_breakable_pos_;
+                tail_col_ = 0;
+                tail_unsure_ = 0;
+            }
+            else
+            {
+                col_ += tail_col_;
+                pos_ = i;
+                resume_ = true;
+            }
+            return true;
+        }
+
+check_breakable:
+        // A breakable position encountered before the right margin
+        if (brk == LINEBREAK_ALLOWBREAK)
+        {
+            if (ch == '/' && col_ > 8)
+            {
+                size_t before = back(i, 2);
+                size_t far_before = back(i, 7);
+
+                // Ignore the breaking chance if there is a chance
+                // immediately before: no break inside "c/o", and no
+                // break after "http://" in a long line.
+                if ((before != npos && last_breakable_pos_ > before) ||
+                        (long_line && far_before != npos &&
+                         last_breakable_pos_ > far_before &&
+                         buffer[i - 1] == '/'))
+                {
+                    ++tail_unsure_;
+                    i = next;
+                    continue;
+                }
+                // Special rule to treat Unix paths more nicely
+                if (next < len && buffer[next] != ' ' && buffer[i - 1] == ' ')
+                {
+                    last_breakable_pos_ = i;
+                    tail_col_ = w;
+                    tail_unsure_ = 1;
+                    i = next;
+                    continue;
+                }
+            }
+            last_breakable_pos_ = next;
+            tail_col_ = 0;
+            tail_unsure_ = 0;
+        }
+        i = next;
+    }
+    pos_ = i;
+    if (last_break_pos_ < len)
+    {   // The last line, which does not end in a line break
+        put(line, len, false, true);
+        last_break_pos_ = last_breakable_pos_ = len;
+        return true;
+    }
+    return false;
+}
+
+/* Break "text" into lines at once */
+template <typename CharT>
+std::vector<line_view<CharT>> break_lines(std::basic_string_view<CharT> text,
+                                          int width,
+                                          bool keep_indent = false,
+                                          const char *lang = nullptr)
+{
+    line_iterator<CharT> it(text, width, keep_indent, lang);
+    std::vector<line_view<CharT>> lines;
+    line_view<CharT> line;
+
+    while (it.next(line))
+        lines.push_back(line);
+    return lines;
+}
+
+} // namespace breaktext
+
+#endif // BREAKTEXT_HPP
@@ -0,0 +1,378 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * cjk.c: table-driven decoders and encoders of the legacy CJK encodings
+ *
+ * The double-byte tables are shared where the encodings are related:
+ * Shift_JIS is mapped to JIS X 0208 in EUC-JP form arithmetically.
+ * Encoding uses a reverse table of the BMP, built on first use.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cjk.h"
+
+#define CJK_GB18030     0
+#define CJK_BIG5        1
+#define CJK_SHIFT_JIS   2
+#define CJK_EUC_JP      3
+#define CJK_EUC_KR      4
+
+/* Half-width katakana, single bytes 0xA1-0xDF in Shift_JIS */
+#define HALFWIDTH_FIRST 0xFF61
+#define HALFWIDTH_LAST  0xFF9F
+
+/* Four-byte GB18030 sequences for the BMP are numbered from 0x81308130,
+ * and those for other planes from 0x90308130 */
+#define GB18030_BMP_COUNT   39420
+#define GB18030_SMP_START   189000
+
+#define INVALID_CHAR    0xFFFD
+
+struct cjk_codec
+{
+    const char *name;
+    int type;
+    const struct cjk_table *table;
+    /* Reverse table of the BMP: lead << 8 | trail, or 0 if none.  The
+     * JIS X 0212 characters of EUC-JP have the high bit of the lead
+     * byte cleared. */
+    unsigned short *encode;
+};
+
+static struct cjk_codec codecs[] =
+{
+    {"gb18030",   CJK_GB18030,   &gb18030_table,  NULL},
+    {"big5",      CJK_BIG5,      &big5_table,     NULL},
+    {"shift_jis", CJK_SHIFT_JIS, &jisx0208_table, NULL},
+    {"euc-jp",    CJK_EUC_JP,    &jisx0208_table, NULL},
+    {"euc-kr",    CJK_EUC_KR,    &ksc5601_table,  NULL}
+};
+
+struct cjk_codec *cjk_find_codec(const char *name)
+{
+    size_t i;
+
+    if (strcmp(name, "gbk") == 0)
+        name = "gb18030";
+    for (i = 0; i < sizeof codecs / sizeof codecs[0]; ++i)
+    {
+        if (strcmp(name, codecs[i].name) == 0)
+            return &codecs[i];
+    }
+    return NULL;
+}
+
+const char *cjk_codec_name(const struct cjk_codec *codec)
+{
+    return codec->name;
+}
+
+static unsigned int lookup(const struct cjk_table *table,
+                           unsigned int lead, unsigned int trail)
+{
+    if (lead < table->lead_first || lead > table->lead_last ||
+            trail < table->trail_first || trail > table->trail_last)
+        return 0;
+    return table->chars[(lead - table->lead_first) *
+                        (table->trail_last - table->trail_first + 1) +
+                        trail - table->trail_first];
+}
+
+static unsigned long gb18030_four_byte(unsigned long index)
+{
+    size_t bot, top, mid;
+
+    if (index >= GB18030_SMP_START)
+    {
+        index -= GB18030_SMP_START;
+        return index < 0x100000 ? 0x10000 + index : INVALID_CHAR;
+    }
+    if (index >= GB18030_BMP_COUNT || index < gb18030_ranges[0].index)
+        return INVALID_CHAR;
+
+    /* Find the last run starting at or before index */
+    bot = 0;
+    top = gb18030_range_count;
+    while (top - bot > 1)
+    {
+        mid = (bot + top) / 2;
+        if (gb18030_ranges[mid].index <= index)
+            bot = mid;
+        else
+            top = mid;
+    }
+    return gb18030_ranges[bot].ch + (index - gb18030_ranges[bot].index);
+}
+
+/*
+ * Decode a non-ASCII character at "s[len]" into "*ch".  Returns the
+ * number of bytes used (decoding an invalid byte as INVALID_CHAR), or
+ * 0 if more bytes are needed.
+ */
+static size_t decode_char(const struct cjk_codec *codec,
+                          const unsigned char *s, size_t len,
+                          unsigned long *ch)
+{
+    unsigned int row, col;
+
+    *ch = INVALID_CHAR;
+    switch (codec->type)
+    {
+    case CJK_GB18030:
+        if (s[0] == 0x80 || s[0] == 0xFF)
+            return 1;
+        if (len < 2)
+            return 0;
+        if (s[1] >= 0x30 && s[1] <= 0x39)
+        {
+            if (len < 4)
+                return 0;
+            if (s[2] < 0x81 || s[2] > 0xFE || s[3] < 0x30 || s[3] > 0x39)
+                return 1;
+            *ch = gb18030_four_byte((((s[0] - 0x81) * 10UL +
+                                      (s[1] - 0x30)) * 126 +
+                                     (s[2] - 0x81)) * 10 + (s[3] - 0x30));
+            return 4;
+        }
+        break;
+    case CJK_SHIFT_JIS:
+        if (s[0] >= 0xA1 && s[0] <= 0xDF)
+        {
+            *ch = HALFWIDTH_FIRST + (s[0] - 0xA1);
+            return 1;
+        }
+        if (s[0] < 0x81 || (s[0] > 0x9F && s[0] < 0xE0) || s[0] > 0xEF)
+            return 1;
+        if (len < 2)
+            return 0;
+        if (s[1] < 0x40 || s[1] == 0x7F || s[1] > 0xFC)
+            return 1;
+        /* Each lead byte covers two rows of JIS X 0208 */
+        row = (s[0] < 0xA0 ? s[0] - 0x81 : s[0] - 0xC1) * 2;
+        if (s[1] >= 0x9F)
+        {
+            ++row;
+            col = s[1] - 0x9F;
+        }
+        else
+        {
+            col = s[1] - (s[1] > 0x7F ? 0x41 : 0x40);
+        }
+        if ( (*ch = lookup(codec->table, 0xA1 + row, 0xA1 + col)) == 0)
+        {
+            *ch = INVALID_CHAR;
+            return 1;
+        }
+        return 2;
+    case CJK_EUC_JP:
+        if (s[0] == 0x8E || s[0] == 0x8F)
+        {
+            if (len < (size_t)(s[0] == 0x8E ? 2 : 3))
+                return 0;
+            if (s[0] == 0x8E)
+            {
+                if (s[1] < 0xA1 || s[1] > 0xDF)
+                    return 1;
+                *ch = HALFWIDTH_FIRST + (s[1] - 0xA1);
+                return 2;
+            }
+            if ( (*ch = lookup(&jisx0212_table, s[1], s[2])) == 0)
+            {
+                *ch = INVALID_CHAR;
+                return 1;
+            }
+            return 3;
+        }
+        break;
+    default:
+        break;
+    }
+
+    /* Double-byte characters */
+    if (s[0] < codec->table->lead_first || s[0] > codec->table->lead_last)
+        return 1;
+    if (len < 2)
+        return 0;
+    if ( (*ch = lookup(codec->table, s[0], s[1])) == 0)
+    {
+        *ch = INVALID_CHAR;
+        return 1;
+    }
+    return 2;
+}
+
+size_t cjk_decode(const struct cjk_codec *codec, const unsigned char *bytes,
+                  size_t len, int final, wchar_t *text, size_t room,
+                  size_t *used)
+{
+    size_t i = 0, c = 0, n;
+    unsigned long ch;
+
+    while (i < len && c < room)
+    {
+        if (bytes[i] < 0x80)
+        {
+            text[c++] = bytes[i++];
+            continue;
+        }
+        if ( (n = decode_char(codec, bytes + i, len - i, &ch)) == 0)
+        {   /* Incomplete character */
+            if (!final)
+                break;
+            ch = INVALID_CHAR;
+            n = 1;
+        }
+        if (sizeof(wchar_t) == 2 && ch >= 0x10000)
+        {
+            if (room - c < 2)
+                break;
+            text[c++] = (wchar_t)(0xD800 + ((ch - 0x10000) >> 10));
+            text[c++] = (wchar_t)(0xDC00 + (ch & 0x3FF));
+        }
+        else
+        {
+            text[c++] = (wchar_t)ch;
+        }
+        i += n;
+    }
+    *used = i;
+    return c;
+}
+
+/*
+ * Add the characters in "table" to the reverse table.  Of duplicate
+ * mappings in a table, the last is used, as it is the one in the main
+ * block of Big5; the characters already added from other tables are
+ * kept.
+ */
+static void add_table(unsigned short *encode, const struct cjk_table *table,
+                      unsigned int lead_mask, int replace)
+{
+    unsigned int lead, trail, ch;
+
+    for (lead = table->lead_first; lead <= table->lead_last; ++lead)
+    {
+        for (trail = table->trail_first; trail <= table->trail_last; ++trail)
+        {
+            ch = lookup(table, lead, trail);
+            if (ch && (replace || encode[ch] == 0))
+                encode[ch] = (unsigned short)((lead & lead_mask) << 8 |
+                                              trail);
+        }
+    }
+}
+
+int cjk_init_encoder(struct cjk_codec *codec)
+{
+    if (codec->encode)
+        return 0;
+    if ( (codec->encode = calloc(0x10000, sizeof(unsigned short))) == NULL)
+        return -1;
+    add_table(codec->encode, codec->table, 0xFF, 1);
+    if (codec->type == CJK_EUC_JP)
+        add_table(codec->encode, &jisx0212_table, 0x7F, 0);
+    return 0;
+}
+
+static size_t gb18030_encode(unsigned long ch, unsigned char *bytes)
+{
+    unsigned long index;
+    size_t bot, top, mid;
+
+    if (ch >= 0x10000)
+    {
+        index = GB18030_SMP_START + (ch - 0x10000);
+    }
+    else
+    {
+        /* Find the last run starting at or before ch */
+        bot = 0;
+        top = gb18030_range_count;
+        while (top - bot > 1)
+        {
+            mid = (bot + top) / 2;
+            if (gb18030_ranges[mid].ch <= ch)
+                bot = mid;
+            else
+                top = mid;
+        }
+        if (ch < gb18030_ranges[bot].ch)
+            return 0;
+        index = gb18030_ranges[bot].index + (ch - gb18030_ranges[bot].ch);
+        if ((bot + 1 < gb18030_range_count &&
+                    index >= gb18030_ranges[bot + 1].index) ||
+                index >= GB18030_BMP_COUNT)
+            return 0;
+    }
+    bytes[3] = (unsigned char)(0x30 + index % 10);
+    index /= 10;
+    bytes[2] = (unsigned char)(0x81 + index % 126);
+    index /= 126;
+    bytes[1] = (unsigned char)(0x30 + index % 10);
+    bytes[0] = (unsigned char)(0x81 + index / 10);
+    return 4;
+}
+
+size_t cjk_encode(const struct cjk_codec *codec, unsigned long ch,
+                  unsigned char *bytes)
+{
+    unsigned int code = 0;
+    unsigned int row, col;
+    size_t n;
+
+    if (ch < 0x80)
+    {
+        bytes[0] = (unsigned char)ch;
+        return 1;
+    }
+    if (ch >= HALFWIDTH_FIRST && ch <= HALFWIDTH_LAST &&
+            (codec->type == CJK_SHIFT_JIS || codec->type == CJK_EUC_JP))
+    {
+        if (codec->type == CJK_EUC_JP)
+        {
+            bytes[0] = 0x8E;
+            bytes[1] = (unsigned char)(0xA1 + (ch - HALFWIDTH_FIRST));
+            return 2;
+        }
+        bytes[0] = (unsigned char)(0xA1 + (ch - HALFWIDTH_FIRST));
+        return 1;
+    }
+    if (ch < 0x10000)
+        code = codec->encode[ch];
+
+    if (code == 0)
+    {
+        if (codec->type == CJK_GB18030 &&
+                (n = gb18030_encode(ch, bytes)) > 0)
+            return n;
+        bytes[0] = '?';
+        return 1;
+    }
+    switch (codec->type)
+    {
+    case CJK_SHIFT_JIS:
+        row = (code >> 8) - 0xA1;
+        col = (code & 0xFF) - 0xA1;
+        bytes[0] = (unsigned char)(row / 2 + (row < 62 ? 0x81 : 0xC1));
+        if (row % 2)
+            bytes[1] = (unsigned char)(col + 0x9F);
+        else
+            bytes[1] = (unsigned char)(col + (col < 63 ? 0x40 : 0x41));
+        return 2;
+    case CJK_EUC_JP:
+        if (code < 0x8000)
+        {   /* JIS X 0212 */
+            bytes[0] = 0x8F;
+            bytes[1] = (unsigned char)(code >> 8 | 0x80);
+            bytes[2] = (unsigned char)(code & 0xFF);
+            return 3;
+        }
+        break;
+    default:
+        break;
+    }
+    bytes[0] = (unsigned char)(code >> 8);
+    bytes[1] = (unsigned char)(code & 0xFF);
+    return 2;
+}
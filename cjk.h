@@ -0,0 +1,84 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * cjk.h: table-driven decoders and encoders of the legacy CJK encodings
+ *
+ * GB18030 (also used for GBK, its subset), Big5, Shift_JIS, EUC-JP, and
+ * EUC-KR are supported, without depending on the locales of the system.
+ */
+
+#ifndef CJK_H
+#define CJK_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+/* Longest byte sequence of a character */
+#define CJK_MAXBYTES    4
+
+/*
+ * Decoding table of a double-byte range:
+ * chars[(lead - lead_first) * (trail_last - trail_first + 1) +
+ *       trail - trail_first] is the character, or 0 if none.
+ */
+struct cjk_table
+{
+    unsigned char lead_first;
+    unsigned char lead_last;
+    unsigned char trail_first;
+    unsigned char trail_last;
+    const unsigned short *chars;
+};
+
+/* Start of a run of GB18030 four-byte sequences mapped to consecutive
+ * characters */
+struct cjk_range
+{
+    unsigned int index;
+    unsigned int ch;
+};
+
+/* Tables generated by gencjk.py */
+extern const struct cjk_table gb18030_table;
+extern const struct cjk_table big5_table;
+extern const struct cjk_table jisx0208_table;   /* In EUC-JP */
+extern const struct cjk_table jisx0212_table;   /* In EUC-JP after 0x8F */
+extern const struct cjk_table ksc5601_table;
+extern const struct cjk_range gb18030_ranges[];
+extern const size_t gb18030_range_count;
+
+struct cjk_codec;
+
+/*
+ * Find the codec named "gb18030", "gbk", "big5", "shift_jis", "euc-jp",
+ * or "euc-kr".  Returns NULL if the name is unknown.
+ */
+struct cjk_codec *cjk_find_codec(const char *name);
+
+const char *cjk_codec_name(const struct cjk_codec *codec);
+
+/*
+ * Decode "bytes[len]" into "text", which has room for "room" characters.
+ * Invalid bytes are decoded as U+FFFD.  Unless "final" is nonzero, a
+ * character cut at the end is left for the next call.  Returns the
+ * number of characters stored, and stores the number of bytes used in
+ * "*used".
+ */
+size_t cjk_decode(const struct cjk_codec *codec, const unsigned char *bytes,
+                  size_t len, int final, wchar_t *text, size_t room,
+                  size_t *used);
+
+/*
+ * Build the table needed by cjk_encode.  Returns 0 on success, or -1 if
+ * out of memory.
+ */
+int cjk_init_encoder(struct cjk_codec *codec);
+
+/*
+ * Encode the character "ch" into "bytes", and return the number of
+ * bytes.  A character that cannot be encoded is output as '?'.
+ */
+size_t cjk_encode(const struct cjk_codec *codec, unsigned long ch,
+                  unsigned char *bytes);
+
+#endif /* CJK_H */
@@ -0,0 +1,103 @@
+#!/usr/bin/env python3
+# vim: set et sts=4 sw=4:
+
+"""
+gencjk.py: generate cjktables.c, the decoding tables of the legacy CJK
+encodings in cjk.c, from the codecs of Python.
+
+Usage: python3 gencjk.py > cjktables.c
+"""
+
+import sys
+
+
+def decode_char(codec, seq):
+    """Return the code point of the byte sequence, or 0 if invalid."""
+    try:
+        s = seq.decode(codec)
+    except UnicodeDecodeError:
+        return 0
+    if len(s) != 1 or ord(s) > 0xFFFF:
+        return 0
+    return ord(s)
+
+
+def double_byte_table(name, codec, leads, trails, prefix=b''):
+    """Output the table of a double-byte range, and its cjk_table."""
+    out = sys.stdout
+    chars = [decode_char(codec, prefix + bytes([lead, trail]))
+             for lead in leads for trail in trails]
+    # Some sequences are only produced by encoding, like the Hangul
+    # filler in EUC-KR, which also starts composed syllables
+    for c in range(0x80, 0x10000):
+        try:
+            seq = chr(c).encode(codec)
+        except UnicodeEncodeError:
+            continue
+        if (len(seq) == len(prefix) + 2 and seq.startswith(prefix) and
+                seq[-2] in leads and seq[-1] in trails):
+            i = (seq[-2] - leads[0]) * len(trails) + seq[-1] - trails[0]
+            if chars[i] == 0:
+                chars[i] = c
+    out.write('static const unsigned short %s_chars[%d] =\n{\n'
+              % (name, len(chars)))
+    for i in range(0, len(chars), 8):
+        out.write('    ' + ' '.join('0x%04x,' % c for c in chars[i:i + 8])
+                  + '\n')
+    out.write('};\n\n')
+    out.write('const struct cjk_table %s_table =\n{\n'
+              '    0x%02x, 0x%02x, 0x%02x, 0x%02x, %s_chars\n};\n\n'
+              % (name, leads[0], leads[-1], trails[0], trails[-1], name))
+
+
+def gb18030_ranges():
+    """Output the linear ranges of the four-byte BMP part of GB18030."""
+    out = sys.stdout
+    ranges = []
+    last = None
+    for index in range(39420):
+        b4 = index % 10
+        b3 = index // 10 % 126
+        b2 = index // 1260 % 10
+        b1 = index // 12600
+        seq = bytes([0x81 + b1, 0x30 + b2, 0x81 + b3, 0x30 + b4])
+        c = decode_char('gb18030', seq)
+        if c == 0:
+            continue
+        if last is None or c != last[1] + index - last[0]:
+            ranges.append((index, c))
+        last = ranges[-1]
+    out.write('/* Starts of the runs of four-byte sequences (numbered from '
+              '0x81308130)\n * mapped to consecutive BMP characters */\n')
+    out.write('const struct cjk_range gb18030_ranges[%d] =\n{\n'
+              % len(ranges))
+    for i in range(0, len(ranges), 4):
+        out.write('    ' + ' '.join('{%5d, 0x%04x},' % r
+                                    for r in ranges[i:i + 4]) + '\n')
+    out.write('};\n\n')
+    out.write('const size_t gb18030_range_count = %d;\n' % len(ranges))
+
+
+def main():
+    sys.stdout.write('''/*
+ * cjktables.c: decoding tables of the legacy CJK encodings
+ *
+ * Generated by gencjk.py from the codecs of Python %d.%d.  Do not edit.
+ */
+
+#include "cjk.h"
+
+''' % sys.version_info[:2])
+    euc = range(0xa1, 0xff)
+    double_byte_table('gb18030', 'gb18030', range(0x81, 0xff),
+                      range(0x40, 0xff))
+    double_byte_table('big5', 'big5', range(0xa1, 0xfa), range(0x40, 0xff))
+    # Shift_JIS is converted to EUC-JP to use the same table
+    double_byte_table('jisx0208', 'euc_jp', euc, euc)
+    double_byte_table('jisx0212', 'euc_jp', euc, euc, b'\x8f')
+    double_byte_table('ksc5601', 'euc_kr', euc, euc)
+    gb18030_ranges()
+
+
+if __name__ == '__main__':
+    main()
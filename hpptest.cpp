@@ -0,0 +1,267 @@
+// vim: set et sts=4 sw=4:
+
+/*
+ * hpptest.cpp: test of breaktext.hpp
+ *
+ * Each string is broken with the line iterator of breaktext.hpp in
+ * UTF-8, UTF-16, and UTF-32, and the lines must be the same as those
+ * from line_iter_next of breaktext.c on the same string followed by a
+ * line feed (if it is not empty and does not end in one).  A few
+ * results are checked literally as well.
+ *
+ * Usage: hpptest
+ */
+
+#include <stdio.h>
+#include <wchar.h>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "breaktext.hpp"
+
+namespace {
+
+int failures = 0;
+
+/* A line as code points, for comparing lines in different encodings */
+struct plain_line
+{
+    std::u32string text;
+    int indent;
+    bool hyphen;
+    bool hard;
+
+    bool operator==(const plain_line &rhs) const
+    {
+        return text == rhs.text && indent == rhs.indent &&
+               hyphen == rhs.hyphen && hard == rhs.hard;
+    }
+};
+
+std::string to_utf8(const std::u32string &s)
+{
+    std::string result;
+
+    for (char32_t c : s)
+    {
+        if (c < 0x80)
+        {
+            result += static_cast<char>(c);
+        }
+        else if (c < 0x800)
+        {
+            result += static_cast<char>(0xC0 | c >> 6);
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else if (c < 0x10000)
+        {
+            result += static_cast<char>(0xE0 | c >> 12);
+            result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+        else
+        {
+            result += static_cast<char>(0xF0 | c >> 18);
+            result += static_cast<char>(0x80 | (c >> 12 & 0x3F));
+            result += static_cast<char>(0x80 | (c >> 6 & 0x3F));
+            result += static_cast<char>(0x80 | (c & 0x3F));
+        }
+    }
+    return result;
+}
+
+std::u16string to_utf16(const std::u32string &s)
+{
+    std::u16string result;
+
+    for (char32_t c : s)
+    {
+        if (c < 0x10000)
+        {
+            result += static_cast<char16_t>(c);
+        }
+        else
+        {
+            result += static_cast<char16_t>(0xD800 + ((c - 0x10000) >> 10));
+            result += static_cast<char16_t>(0xDC00 + (c & 0x3FF));
+        }
+    }
+    return result;
+}
+
+template <typename CharT>
+std::u32string decode(std::basic_string_view<CharT> s)
+{
+    std::u32string result;
+    size_t i = 0;
+
+    while (i < s.size())
+        result += breaktext::unit_traits<CharT>::decode(s.data(), s.size(),
+                                                        i);
+    return result;
+}
+
+/* The lines from breaktext.hpp */
+template <typename CharT>
+std::vector<plain_line> break_hpp(std::basic_string_view<CharT> text,
+                                  int line_width, bool indent)
+{
+    std::vector<plain_line> result;
+
+    for (const auto &line : breaktext::break_lines(text, line_width, indent))
+        result.push_back({decode(line.text), line.indent, line.hyphen,
+                          line.hard});
+    return result;
+}
+
+/* The lines from line_iter_next */
+std::vector<plain_line> break_c(const std::u32string &text, int line_width,
+                                bool indent)
+{
+    std::wstring wtext;
+    std::vector<plain_line> result;
+    struct line_iter it;
+    struct line line;
+
+    for (char32_t c : text)
+    {
+        if (sizeof(wchar_t) == 2 && c >= 0x10000)
+        {
+            wtext += static_cast<wchar_t>(0xD800 + ((c - 0x10000) >> 10));
+            wtext += static_cast<wchar_t>(0xDC00 + (c & 0x3FF));
+        }
+        else
+        {
+            wtext += static_cast<wchar_t>(c);
+        }
+    }
+    if (wtext.empty())
+        return result;
+    if (wtext.back() != L'\n')
+        wtext += L'\n';
+
+    std::vector<unsigned char> brks(BRKS_SIZE(wtext.size()));
+    std::vector<unsigned char> widths(wtext.size());
+    width = line_width;
+    keep_indent = indent;
+    find_breaks(wtext.data(), wtext.size(), nullptr, brks.data());
+    set_widths(wtext.data(), wtext.size(), widths.data());
+    line_iter_init(&it, wtext.data(), brks.data(), widths.data(), 0,
+                   wtext.size());
+    while (line_iter_next(&it, &line))
+    {
+        std::wstring_view w(wtext.data() + line.begin,
+                            line.end - line.begin);
+        std::u32string s;
+        for (size_t i = 0; i < w.size(); ++i)
+        {
+            char32_t c = static_cast<char32_t>(w[i]);
+            if (sizeof(wchar_t) == 2 && c >= 0xD800 && c < 0xDC00 &&
+                    i + 1 < w.size())
+                c = 0x10000 + ((c - 0xD800) << 10) + (w[++i] - 0xDC00);
+            s += c;
+        }
+        result.push_back({s, line.indent, line.hyphen != 0,
+                          line.hard != 0});
+    }
+    return result;
+}
+
+void check(bool ok, const char *what, const std::u32string &text,
+           int line_width, bool indent)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s, \"%s\", width %d%s\n", what, to_utf8(text).c_str(),
+               line_width, indent ? ", keeping indentation" : "");
+        ++failures;
+    }
+}
+
+void compare(const std::u32string &text, int line_width, bool indent)
+{
+    std::vector<plain_line> expected = break_c(text, line_width, indent);
+    std::string utf8 = to_utf8(text);
+    std::u16string utf16 = to_utf16(text);
+
+    check(break_hpp(std::string_view(utf8), line_width, indent) ==
+              expected, "char", text, line_width, indent);
+    check(break_hpp(std::u16string_view(utf16), line_width, indent) ==
+              expected, "char16_t", text, line_width, indent);
+    check(break_hpp(std::u32string_view(text), line_width, indent) ==
+              expected, "char32_t", text, line_width, indent);
+}
+
+/* The texts of the lines of "text" broken at "line_width" */
+template <typename CharT>
+std::vector<std::basic_string<CharT>> texts(std::basic_string_view<CharT> text,
+                                            int line_width)
+{
+    std::vector<std::basic_string<CharT>> result;
+
+    for (const auto &line : breaktext::break_lines(text, line_width))
+        result.emplace_back(line.text);
+    return result;
+}
+
+} // unnamed namespace
+
+int main()
+{
+    static const char32_t *const strings[] =
+    {
+        U"",
+        U"hello world",
+        U"hello world\n",
+        U"The quick brown fox jumps over the lazy dog.",
+        U"  Indented text that is long enough to wrap more than once here",
+        U"First paragraph.\nSecond paragraph, which is longer.\n\nThird",
+        U"\u4E2D\u6587\u548C English \u6DF7\u5408\u7684\u4E00\u884C"
+        U"\u6587\u5B57\uFF0C\u6CA1\u6709\u6362\u884C",
+        U"Emoji \U0001F600\U0001F601 and \U0001D4B3\U0001D4B4\U0001D4B5 "
+        U"letters outside the BMP",
+        U"C++ is not broken, nor is c/o, but http://example.com/a/b is",
+        U"Supercalifragilisticexpialidocious",
+        U"ends with spaces   ",
+        U"x",
+        U"\u4E2D",
+        U"\U0001F600",
+        U"Line ending in CR LF\r\n",
+        U"Line separator\u2028and the rest"
+    };
+    static const int line_widths[] = {2, 5, 10, 20, 72};
+
+    init_linebreak();
+    init_widths();
+
+    for (const char32_t *s : strings)
+    {
+        for (int w : line_widths)
+        {
+            compare(s, w, false);
+            compare(s, w, true);
+        }
+    }
+
+    /* The last character is kept without a line feed after it */
+    check(texts(std::string_view("hello world"), 20) ==
+              std::vector<std::string>{"hello world"},
+          "char, literal", U"hello world", 20, false);
+    check(texts(std::u16string_view(u"hello world"), 20) ==
+              std::vector<std::u16string>{u"hello world"},
+          "char16_t, literal", U"hello world", 20, false);
+    check(texts(std::u32string_view(U"hello world"), 8) ==
+              std::vector<std::u32string>{U"hello ", U"world"},
+          "char32_t, literal", U"hello world", 8, false);
+    check(texts(std::u32string_view(U"hello world\n"), 20) ==
+              std::vector<std::u32string>{U"hello world"},
+          "char32_t, literal", U"hello world\n", 20, false);
+
+    if (failures)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
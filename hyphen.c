@@ -0,0 +1,463 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * hyphen.c: Liang-style hyphenation with precompiled pattern tries
+ *
+ * The trie file consists of a hyphen_header, the nodes, and the pattern
+ * digits, all in the native byte order.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include "hyphen.h"
+
+#ifdef _WIN32
+#define HYPHEN_NO_MMAP
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#define HYPHEN_MAGIC        "BTHY"
+#define HYPHEN_VERSION      1
+#define HYPHEN_BYTE_ORDER   0x01020304
+#define NO_NODE             ((unsigned int)-1)
+
+/* Node of the trie under construction, with linked children */
+struct build_node
+{
+    unsigned int ch;
+    unsigned int child;
+    unsigned int sibling;
+    unsigned int values;
+};
+
+struct builder
+{
+    struct build_node *nodes;
+    size_t node_count;
+    size_t node_cap;
+    unsigned char *values;
+    size_t value_size;
+    size_t value_cap;
+};
+
+static int grow(void **ptr, size_t *cap, size_t need, size_t elem_size)
+{
+    void *new_ptr;
+    size_t new_cap = *cap ? *cap : 1024;
+
+    if (need <= *cap)
+        return 0;
+    while (new_cap < need)
+        new_cap *= 2;
+    if ( (new_ptr = realloc(*ptr, new_cap * elem_size)) == NULL)
+        return -1;
+    *ptr = new_ptr;
+    *cap = new_cap;
+    return 0;
+}
+
+static unsigned int new_node(struct builder *b, unsigned int ch)
+{
+    struct build_node *node;
+
+    if (grow((void **)&b->nodes, &b->node_cap, b->node_count + 1,
+             sizeof(struct build_node)) < 0)
+        return NO_NODE;
+    node = &b->nodes[b->node_count];
+    node->ch = ch;
+    node->child = NO_NODE;
+    node->sibling = NO_NODE;
+    node->values = 0;
+    return (unsigned int)b->node_count++;
+}
+
+static int add_pattern(struct builder *b, const unsigned int *letters,
+                       const unsigned char *digits, size_t len)
+{
+    unsigned int node = 0;
+    unsigned int child;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        for (child = b->nodes[node].child; child != NO_NODE;
+                child = b->nodes[child].sibling)
+        {
+            if (b->nodes[child].ch == letters[i])
+                break;
+        }
+        if (child == NO_NODE)
+        {
+            if ( (child = new_node(b, letters[i])) == NO_NODE)
+                return -1;
+            b->nodes[child].sibling = b->nodes[node].child;
+            b->nodes[node].child = child;
+        }
+        node = child;
+    }
+
+    if (grow((void **)&b->values, &b->value_cap, b->value_size + len + 1,
+             1) < 0)
+        return -1;
+    memcpy(b->values + b->value_size, digits, len + 1);
+    b->nodes[node].values = (unsigned int)b->value_size + 1;
+    b->value_size += len + 1;
+    return 0;
+}
+
+static int compare_node(const void *a, const void *b)
+{
+    unsigned int x = ((const struct hyphen_node *)a)->ch;
+    unsigned int y = ((const struct hyphen_node *)b)->ch;
+    return (x > y) - (x < y);
+}
+
+/*
+ * Lay the trie out breadth first, so that the children of each node are
+ * adjacent, and sort them for binary search.
+ */
+static struct hyphen_node *flatten(struct builder *b)
+{
+    struct hyphen_node *nodes;
+    unsigned int *origin;
+    size_t head, tail;
+    unsigned int child;
+
+    nodes = malloc(b->node_count * sizeof(struct hyphen_node));
+    origin = malloc(b->node_count * sizeof(unsigned int));
+    if (nodes == NULL || origin == NULL)
+    {
+        free(nodes);
+        free(origin);
+        return NULL;
+    }
+
+    nodes[0].ch = 0;
+    nodes[0].values = b->nodes[0].values;
+    origin[0] = 0;
+    tail = 1;
+    for (head = 0; head < tail; ++head)
+    {
+        nodes[head].first_child = (unsigned int)tail;
+        for (child = b->nodes[origin[head]].child; child != NO_NODE;
+                child = b->nodes[child].sibling)
+        {
+            nodes[tail].ch = b->nodes[child].ch;
+            nodes[tail].values = b->nodes[child].values;
+            /* Keep the build index in first_child while sorting */
+            nodes[tail].first_child = child;
+            ++tail;
+        }
+        nodes[head].child_count = (unsigned int)tail -
+                                  nodes[head].first_child;
+        qsort(nodes + nodes[head].first_child, nodes[head].child_count,
+              sizeof(struct hyphen_node), compare_node);
+        for (child = nodes[head].first_child; child < tail; ++child)
+        {
+            origin[child] = nodes[child].first_child;
+        }
+    }
+
+    free(origin);
+    return nodes;
+}
+
+int hyphen_compile(const wchar_t *patterns, size_t len,
+                   const char *filename)
+{
+    struct builder b;
+    struct hyphen_header header;
+    struct hyphen_node *nodes = NULL;
+    unsigned int letters[HYPHEN_MAXWORD + 2];
+    unsigned char digits[HYPHEN_MAXWORD + 3];
+    size_t i = 0, n;
+    wchar_t ch;
+    FILE *fp;
+    int result = -1;
+
+    memset(&b, 0, sizeof b);
+    if (new_node(&b, 0) == NO_NODE)
+        goto done;
+
+    while (i < len)
+    {
+        ch = patterns[i];
+        if (ch == L'%')
+        {   /* Comment till the end of line */
+            while (i < len && patterns[i] != L'\n')
+                ++i;
+            continue;
+        }
+        if (iswspace(ch) || ch == L'{' || ch == L'}')
+        {
+            ++i;
+            continue;
+        }
+        if (ch == L'\\')
+        {   /* TeX command, like \patterns */
+            while (i < len && !iswspace(patterns[i]) && patterns[i] != L'{')
+                ++i;
+            continue;
+        }
+
+        /* A pattern: letters with optional digits between them */
+        n = 0;
+        digits[0] = 0;
+        while (i < len && !iswspace(patterns[i]) && patterns[i] != L'%' &&
+                patterns[i] != L'{' && patterns[i] != L'}')
+        {
+            ch = patterns[i++];
+            if (ch >= L'0' && ch <= L'9')
+            {
+                digits[n] = (unsigned char)(ch - L'0');
+            }
+            else if (n < HYPHEN_MAXWORD + 2)
+            {
+                letters[n++] = (unsigned int)towlower(ch);
+                digits[n] = 0;
+            }
+        }
+        if (n > 0 && add_pattern(&b, letters, digits, n) < 0)
+            goto done;
+    }
+
+    if ( (nodes = flatten(&b)) == NULL)
+        goto done;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, HYPHEN_MAGIC, sizeof header.magic);
+    header.version = HYPHEN_VERSION;
+    header.byte_order = HYPHEN_BYTE_ORDER;
+    header.node_count = (unsigned int)b.node_count;
+    header.value_size = (unsigned int)b.value_size;
+    header.left_min = 2;
+    header.right_min = 2;
+
+    if ( (fp = fopen(filename, "wb")) == NULL)
+        goto done;
+    if (fwrite(&header, sizeof header, 1, fp) == 1 &&
+            fwrite(nodes, sizeof(struct hyphen_node), b.node_count, fp) ==
+                b.node_count &&
+            fwrite(b.values, 1, b.value_size, fp) == b.value_size)
+    {
+        result = 0;
+    }
+    if (fclose(fp) != 0)
+        result = -1;
+
+done:
+    free(nodes);
+    free(b.nodes);
+    free(b.values);
+    return result;
+}
+
+/*
+ * Check that the nodes of a loaded trie stay inside it: the children of
+ * each node must come after it and end within the nodes, every node but
+ * the root must have exactly one parent (so that its depth is known),
+ * and the digits of a pattern (one more than the depth of its node) must
+ * end within the values.  Returns 0 if the trie is sound, or -1
+ * otherwise.
+ */
+static int check_nodes(const struct hyphen_header *header,
+                       const struct hyphen_node *nodes)
+{
+    unsigned int *depths;
+    unsigned int node, child, end;
+    int result = -1;
+
+    if ( (depths = calloc(header->node_count, sizeof(unsigned int))) ==
+            NULL)
+        return -1;
+    for (node = 0; node < header->node_count; ++node)
+    {
+        /* Only the root may be nobody's child */
+        if (node > 0 && depths[node] == 0)
+            goto done;
+        if (nodes[node].child_count > 0)
+        {
+            if (nodes[node].first_child <= node ||
+                    nodes[node].first_child > header->node_count ||
+                    nodes[node].child_count >
+                        header->node_count - nodes[node].first_child ||
+                    depths[node] >= HYPHEN_MAXWORD + 2)
+                goto done;
+            end = nodes[node].first_child + nodes[node].child_count;
+            for (child = nodes[node].first_child; child < end; ++child)
+            {
+                if (depths[child] != 0)
+                    goto done;
+                depths[child] = depths[node] + 1;
+            }
+        }
+        if (nodes[node].values != 0 &&
+                (nodes[node].values > header->value_size ||
+                 depths[node] + 1 >
+                    header->value_size - (nodes[node].values - 1)))
+            goto done;
+    }
+    result = 0;
+
+done:
+    free(depths);
+    return result;
+}
+
+struct hyphen_trie *hyphen_load(const char *filename)
+{
+    struct hyphen_trie *trie;
+    const struct hyphen_header *header;
+#ifdef HYPHEN_NO_MMAP
+    FILE *fp;
+    long size;
+#else
+    int fd;
+    struct stat st;
+#endif
+
+    if ( (trie = malloc(sizeof(struct hyphen_trie))) == NULL)
+        return NULL;
+
+#ifdef HYPHEN_NO_MMAP
+    trie->data = NULL;
+    if ( (fp = fopen(filename, "rb")) == NULL)
+        goto error;
+    if (fseek(fp, 0, SEEK_END) == 0 && (size = ftell(fp)) >= 0 &&
+            fseek(fp, 0, SEEK_SET) == 0 &&
+            (trie->data = malloc(size ? size : 1)) != NULL &&
+            fread(trie->data, 1, size, fp) == (size_t)size)
+    {
+        trie->size = (size_t)size;
+        fclose(fp);
+    }
+    else
+    {
+        fclose(fp);
+        free(trie->data);
+        goto error;
+    }
+#else
+    if ( (fd = open(filename, O_RDONLY)) < 0)
+        goto error;
+    if (fstat(fd, &st) < 0)
+    {
+        close(fd);
+        goto error;
+    }
+    trie->size = (size_t)st.st_size;
+    trie->data = mmap(NULL, trie->size ? trie->size : 1, PROT_READ,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (trie->data == MAP_FAILED)
+        goto error;
+#endif
+
+    header = trie->data;
+    if (trie->size < sizeof(struct hyphen_header) ||
+            memcmp(header->magic, HYPHEN_MAGIC, sizeof header->magic) != 0 ||
+            header->version != HYPHEN_VERSION ||
+            header->byte_order != HYPHEN_BYTE_ORDER ||
+            header->node_count == 0 ||
+            trie->size != sizeof(struct hyphen_header) +
+                          header->node_count * sizeof(struct hyphen_node) +
+                          header->value_size ||
+            check_nodes(header, (const struct hyphen_node *)(header + 1)) <
+                0)
+    {
+        hyphen_unload(trie);
+        errno = EINVAL;
+        return NULL;
+    }
+    trie->header = header;
+    trie->nodes = (const struct hyphen_node *)(header + 1);
+    trie->values = (const unsigned char *)(trie->nodes + header->node_count);
+    return trie;
+
+error:
+    free(trie);
+    return NULL;
+}
+
+void hyphen_unload(struct hyphen_trie *trie)
+{
+#ifdef HYPHEN_NO_MMAP
+    free(trie->data);
+#else
+    munmap(trie->data, trie->size ? trie->size : 1);
+#endif
+    free(trie);
+}
+
+static unsigned int find_child(const struct hyphen_trie *trie,
+                               unsigned int node, unsigned int ch)
+{
+    const struct hyphen_node *children;
+    int bot, top, mid;
+
+    children = trie->nodes + trie->nodes[node].first_child;
+    bot = 0;
+    top = (int)trie->nodes[node].child_count - 1;
+    while (top >= bot)
+    {
+        mid = (bot + top) / 2;
+        if (children[mid].ch < ch)
+            bot = mid + 1;
+        else if (children[mid].ch > ch)
+            top = mid - 1;
+        else
+            return trie->nodes[node].first_child + mid;
+    }
+    return NO_NODE;
+}
+
+void hyphenate(const struct hyphen_trie *trie, const wchar_t *word,
+               size_t len, char *points)
+{
+    unsigned int letters[HYPHEN_MAXWORD + 2];
+    unsigned char values[HYPHEN_MAXWORD + 3];
+    const unsigned char *digits;
+    unsigned int node;
+    size_t i, j, k;
+
+    /* The word is matched with dots marking its boundaries */
+    letters[0] = L'.';
+    for (i = 0; i < len; ++i)
+        letters[i + 1] = (unsigned int)towlower(word[i]);
+    letters[len + 1] = L'.';
+    memset(values, 0, len + 3);
+
+    for (i = 0; i < len + 2; ++i)
+    {
+        node = 0;
+        for (j = i; j < len + 2; ++j)
+        {
+            if ( (node = find_child(trie, node, letters[j])) == NO_NODE)
+                break;
+            if (trie->nodes[node].values)
+            {
+                digits = trie->values + trie->nodes[node].values - 1;
+                for (k = 0; k <= j - i + 1; ++k)
+                {
+                    if (values[i + k] < digits[k])
+                        values[i + k] = digits[k];
+                }
+            }
+        }
+    }
+
+    /* values[k + 1] is for the position before word[k] */
+    for (k = 0; k <= len; ++k)
+    {
+        points[k] = (values[k + 1] & 1) &&
+                    k >= trie->header->left_min &&
+                    len - k >= trie->header->right_min;
+    }
+}
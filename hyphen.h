@@ -0,0 +1,77 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * hyphen.h: Liang-style hyphenation with precompiled pattern tries
+ *
+ * Patterns in the TeX format (like "a1b" or ".ach4") are compiled once
+ * into a trie file, which is later mapped into memory as is.
+ */
+
+#ifndef HYPHEN_H
+#define HYPHEN_H
+
+#include <stddef.h>
+#include <wchar.h>
+
+/* Longest word that will be hyphenated */
+#define HYPHEN_MAXWORD  100
+
+struct hyphen_header
+{
+    char magic[4];              /* "BTHY" */
+    unsigned int version;
+    unsigned int byte_order;    /* 0x01020304 in the native order */
+    unsigned int node_count;
+    unsigned int value_size;
+    unsigned int left_min;      /* Shortest part before a hyphen */
+    unsigned int right_min;     /* Shortest part after a hyphen */
+};
+
+/*
+ * A trie node.  The children of a node are stored next to each other,
+ * sorted by character.  "values" is the offset plus one of the digits of
+ * the pattern ending at the node (one more than the pattern letters), or
+ * 0 if no pattern ends here.  Node 0 is the root.
+ */
+struct hyphen_node
+{
+    unsigned int ch;
+    unsigned int first_child;
+    unsigned int child_count;
+    unsigned int values;
+};
+
+struct hyphen_trie
+{
+    const struct hyphen_header *header;
+    const struct hyphen_node *nodes;
+    const unsigned char *values;
+    void *data;
+    size_t size;
+};
+
+/*
+ * Compile the patterns in "patterns[len]" into the file "filename".
+ * "%" starts a comment, and TeX commands and braces are ignored.
+ * Returns 0 on success, or -1 with errno set.
+ */
+int hyphen_compile(const wchar_t *patterns, size_t len,
+                   const char *filename);
+
+/*
+ * Map a compiled trie into memory.  Returns NULL with errno set on
+ * failure, which is EINVAL if the file is not a sound trie.
+ */
+struct hyphen_trie *hyphen_load(const char *filename);
+
+void hyphen_unload(struct hyphen_trie *trie);
+
+/*
+ * Find the hyphenation points of "word[len]" (len <= HYPHEN_MAXWORD).
+ * points[k] is set to nonzero if the word may be hyphenated before
+ * word[k], for 0 <= k <= len.
+ */
+void hyphenate(const struct hyphen_trie *trie, const wchar_t *word,
+               size_t len, char *points);
+
+#endif /* HYPHEN_H */
@@ -0,0 +1,158 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * hyphtest.c: test of loading hyphenation tries
+ *
+ * A trie compiled from patterns must load and hyphenate as the patterns
+ * say, and tries made by hand with nodes or pattern digits outside the
+ * file, or with nodes reachable at more than one depth, must be rejected
+ * by hyphen_load with EINVAL.
+ *
+ * Usage: hyphtest
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include "hyphen.h"
+
+#define TEST_FILE   "hyphtest.hyp"
+#define MAXNODES    8
+
+/* A trie made by hand, which is written as is */
+struct raw_trie
+{
+    const char *name;
+    unsigned int node_count;
+    struct hyphen_node nodes[MAXNODES];
+    unsigned int value_size;
+    size_t truncate;            /* Bytes to leave out at the end */
+};
+
+/*
+ * Node 0 is the root, and the fields of a node are the character, the
+ * first child, the number of children, and the offset plus one of the
+ * digits.
+ */
+static const struct raw_trie bad_tries[] =
+{
+    /* The root's children are 1 to 3, and node 1 has node 2 as its child
+     * too; nodes 2 and 3 share node 4, which is at depth 3 through node
+     * 1, but has digits for depth 2 only */
+    {"shared children", 5,
+     {{0, 1, 3, 0}, {'a', 2, 1, 0}, {'b', 4, 1, 0}, {'c', 4, 1, 0},
+      {'d', 0, 0, 1}},
+     3, 0},
+    {"children past the nodes", 2,
+     {{0, 1, 1, 0}, {'a', 2, 5, 0}},
+     0, 0},
+    {"child before its parent", 3,
+     {{0, 1, 1, 0}, {'a', 2, 1, 0}, {'b', 1, 1, 0}},
+     0, 0},
+    {"node without a parent", 3,
+     {{0, 1, 1, 0}, {'a', 0, 0, 0}, {'b', 0, 0, 0}},
+     0, 0},
+    {"digits past the values", 2,
+     {{0, 1, 1, 0}, {'a', 0, 0, 2}},
+     2, 0},
+    {"truncated file", 2,
+     {{0, 1, 1, 0}, {'a', 0, 0, 1}},
+     2, 1}
+};
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+static int write_raw_trie(const struct raw_trie *raw)
+{
+    static unsigned char data[1024];
+    struct hyphen_header header;
+    size_t size;
+    FILE *fp;
+    int result = -1;
+
+    memset(&header, 0, sizeof header);
+    memcpy(header.magic, "BTHY", sizeof header.magic);
+    header.version = 1;
+    header.byte_order = 0x01020304;
+    header.node_count = raw->node_count;
+    header.value_size = raw->value_size;
+    header.left_min = 1;
+    header.right_min = 1;
+
+    /* The values are all zero */
+    memset(data, 0, sizeof data);
+    memcpy(data, &header, sizeof header);
+    memcpy(data + sizeof header, raw->nodes,
+           raw->node_count * sizeof(struct hyphen_node));
+    size = sizeof header + raw->node_count * sizeof(struct hyphen_node) +
+           raw->value_size - raw->truncate;
+
+    if ( (fp = fopen(TEST_FILE, "wb")) == NULL)
+        return -1;
+    if (fwrite(data, 1, size, fp) == size)
+        result = 0;
+    if (fclose(fp) != 0)
+        result = -1;
+    return result;
+}
+
+static void test_patterns(void)
+{
+    static const wchar_t patterns[] = L"\\patterns{ % Comment\n"
+                                      L"a1b b1c c2d }";
+    static const wchar_t word[] = L"abcd";
+    struct hyphen_trie *trie;
+    char points[sizeof word / sizeof word[0]];
+
+    check(hyphen_compile(patterns, wcslen(patterns), TEST_FILE) == 0,
+          "compiling patterns");
+    if ( (trie = hyphen_load(TEST_FILE)) == NULL)
+    {
+        check(0, "loading compiled patterns");
+        return;
+    }
+    /* "a-b" is too close to the start, as left_min is 2 */
+    hyphenate(trie, word, wcslen(word), points);
+    check(!points[0] && !points[1] && points[2] && !points[3] &&
+          !points[4], "hyphenating \"abcd\"");
+    hyphen_unload(trie);
+}
+
+int main(void)
+{
+    struct hyphen_trie *trie;
+    size_t i;
+
+    test_patterns();
+    for (i = 0; i < sizeof bad_tries / sizeof bad_tries[0]; ++i)
+    {
+        if (write_raw_trie(&bad_tries[i]) < 0)
+        {
+            perror("Cannot write test file");
+            return 1;
+        }
+        errno = 0;
+        trie = hyphen_load(TEST_FILE);
+        check(trie == NULL && errno == EINVAL, bad_tries[i].name);
+        if (trie)
+            hyphen_unload(trie);
+    }
+    remove(TEST_FILE);
+
+    if (failures)
+    {
+        printf("%d check(s) failed\n", failures);
+        return 1;
+    }
+    printf("All checks passed\n");
+    return 0;
+}
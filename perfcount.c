@@ -0,0 +1,132 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * perfcount.c: hardware performance counters of the current process
+ */
+
+#include <string.h>
+#include "perfcount.h"
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+const char *perfcount_names[PERFCOUNT_EVENTS] =
+{
+    "cycles",
+    "instructions",
+    "branch-misses",
+    "L1d-misses",
+    "LLC-misses",
+    "page-faults"
+};
+
+#ifdef __linux__
+
+static const struct
+{
+    unsigned int type;
+    unsigned long long config;
+} events[PERFCOUNT_EVENTS] =
+{
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D |
+                         (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS}
+};
+
+int perfcount_open(struct perfcount *pc)
+{
+    struct perf_event_attr attr;
+    int count = 0;
+    int i;
+
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+    {
+        memset(&attr, 0, sizeof attr);
+        attr.size = sizeof attr;
+        attr.type = events[i].type;
+        attr.config = events[i].config;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+                           PERF_FORMAT_TOTAL_TIME_RUNNING;
+        /* Counting only the user space is allowed with the default
+         * perf_event_paranoid setting */
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        /* Count the threads created later too, which are added to the
+         * values read when they exit */
+        attr.inherit = 1;
+        pc->fds[i] = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+        if (pc->fds[i] >= 0)
+            ++count;
+    }
+    return count;
+}
+
+void perfcount_read(const struct perfcount *pc, unsigned long long *values)
+{
+    /* Value, time enabled, and time running */
+    unsigned long long data[3];
+    int i;
+
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+    {
+        values[i] = PERFCOUNT_NONE;
+        if (pc->fds[i] < 0 ||
+                read(pc->fds[i], data, sizeof data) != sizeof data)
+            continue;
+        if (data[2] == 0)
+            values[i] = 0;
+        else if (data[2] < data[1])
+            values[i] = (unsigned long long)((double)data[0] * data[1] /
+                                             data[2]);
+        else
+            values[i] = data[0];
+    }
+}
+
+void perfcount_close(struct perfcount *pc)
+{
+    int i;
+
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+    {
+        if (pc->fds[i] >= 0)
+            close(pc->fds[i]);
+        pc->fds[i] = -1;
+    }
+}
+
+#else /* Not Linux */
+
+int perfcount_open(struct perfcount *pc)
+{
+    int i;
+
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+        pc->fds[i] = -1;
+    return 0;
+}
+
+void perfcount_read(const struct perfcount *pc, unsigned long long *values)
+{
+    int i;
+
+    (void)pc;
+    for (i = 0; i < PERFCOUNT_EVENTS; ++i)
+        values[i] = PERFCOUNT_NONE;
+}
+
+void perfcount_close(struct perfcount *pc)
+{
+    (void)pc;
+}
+
+#endif /* __linux__ */
@@ -0,0 +1,41 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * perfcount.h: hardware performance counters of the current process
+ *
+ * Linux perf_event_open is used.  Each counter is opened separately, so
+ * that those not supported (as is common in containers and virtual
+ * machines) are simply missing, instead of failing the whole set.
+ */
+
+#ifndef PERFCOUNT_H
+#define PERFCOUNT_H
+
+#define PERFCOUNT_EVENTS    6
+#define PERFCOUNT_NONE      ((unsigned long long)-1)
+
+struct perfcount
+{
+    int fds[PERFCOUNT_EVENTS];
+};
+
+/* Names of the counters, like "cycles" */
+extern const char *perfcount_names[PERFCOUNT_EVENTS];
+
+/*
+ * Open and start the counters, which count the calling thread and the
+ * threads it creates afterwards (once they have been joined).  Returns
+ * the number of counters available, which is 0 when not on Linux.
+ */
+int perfcount_open(struct perfcount *pc);
+
+/*
+ * Read the current values of the counters into "values", scaled if the
+ * counters are multiplexed.  PERFCOUNT_NONE is stored for the counters
+ * not available.
+ */
+void perfcount_read(const struct perfcount *pc, unsigned long long *values);
+
+void perfcount_close(struct perfcount *pc);
+
+#endif /* PERFCOUNT_H */
@@ -0,0 +1,259 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * Stress test for the worst cases of the layout in breaktext: generated
+ * texts that go through its slow paths are broken at two sizes, and the
+ * test fails if the time per character at the larger size is more than
+ * MAXRATIO times that at the smaller one, as it would be if the work
+ * grew faster than the text.  It is built without NDEBUG, so that the
+ * work budget of line_iter_next and break_text_parallel is checked too.
+ *
+ * Usage: stress [Corpus Directory]
+ *
+ * With a directory, the texts are also written there in UTF-8, at the
+ * larger size, for trying them with breaktext itself.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <wchar.h>
+
+#define BREAKTEXT_NO_MAIN
+#include "breaktext.c"
+
+#define SMALL_CHARS (512*1024)
+#define LARGE_CHARS (4*SMALL_CHARS)
+#define MAXRATIO    2.0
+#define RUNS        3
+#define ATTEMPTS    3           /* Of a case that seems superlinear */
+
+/* A generated text: "unit" repeated (or words of "word_len" letters if
+ * it is NULL), with a line feed every "line_len" characters (never if
+ * 0) */
+struct pattern
+{
+    const char *name;
+    const wchar_t *unit;
+    size_t word_len;
+    size_t line_len;
+};
+
+/*
+ * Each pattern is known to have taken more work than the others: runs
+ * that cannot be broken, the rules for "C++" and '/', indentation and
+ * spaces at the margin, and words around HYPHEN_MAXWORD letters, which
+ * are hyphenated (or not) with -h.
+ */
+static struct pattern patterns[] =
+{
+    {"letters",       L"a",                    0,                  0},
+    {"cjk",           L"\x4E2D",               0,                  0},
+    {"wide-narrow",   L"a\xFF41",              0,                  0},
+    {"cpp",           L"C++",                  0,                  0},
+    {"cpp-spaced",    L"C++ ",                 0,                  0},
+    {"slashes",       L"a/",                   0,                  0},
+    {"urls",          L"http://",              0,                  0},
+    {"paths",         L" /usr/b",              0,                  0},
+    {"spaces",        L" ",                    0,                  0},
+    {"space-lines",   L" ",                    0,                  1000},
+    {"deep-indent",   L"                    x", 0,                  100},
+    {"margin-spaces", L"word                ", 0,                  0},
+    {"max-words",     NULL,                    HYPHEN_MAXWORD,     0},
+    {"longer-words",  NULL,                    HYPHEN_MAXWORD + 1, 0}
+};
+
+/* Options of a run: width, -i, -h, and -j */
+struct config
+{
+    int width;
+    int keep_indent;
+    int hyphenate;
+    int threads;
+};
+
+static struct config configs[] =
+{
+    {2,  0, 0, 1},
+    {41, 0, 0, 1},
+    {72, 1, 0, 1},
+    {41, 0, 1, 1},
+    {41, 1, 1, 2}               /* As many as SMALL_CHARS can have */
+};
+
+/* Patterns for -h, so that long runs of letters can be hyphenated */
+static const wchar_t hyphen_patterns[] = L"a1b b1c c1d 1na n1a .ab4 4yz.";
+
+static unsigned char *saved_brks;
+static size_t text_len;
+
+static int null_put_line(struct line_sink *sink, const wchar_t *buffer,
+                         const struct line *line)
+{
+    (void)sink;
+    (void)buffer;
+    (void)line;
+    return 0;
+}
+
+static struct line_sink null_sink = {null_put_line};
+
+static void make_text(const struct pattern *pat, size_t len)
+{
+    size_t unit_len = pat->unit ? wcslen(pat->unit) : pat->word_len + 1;
+    size_t i;
+
+    for (i = 0; i < len; ++i)
+    {
+        if (pat->line_len && i % pat->line_len == pat->line_len - 1)
+            buffer[i] = L'\n';
+        else if (pat->unit)
+            buffer[i] = pat->unit[i % unit_len];
+        else if (i % unit_len == pat->word_len)
+            buffer[i] = L' ';
+        else
+            buffer[i] = L'a' + (wchar_t)(i % unit_len % 26);
+    }
+    buffer[len - 1] = L'\n';
+    text_len = len;
+    init_widths();
+    find_breaks(buffer, text_len, NULL, brks);
+    set_widths(buffer, text_len, widths);
+    memcpy(saved_brks, brks, BRKS_SIZE(text_len));
+}
+
+/* Best time of RUNS layouts of the text, per character in nanoseconds */
+static double time_layout(int threads)
+{
+    double best = 0, t;
+    pctimer_t t1;
+    int i;
+
+    for (i = 0; i < RUNS; ++i)
+    {
+        /* Undo the changes of the "C++" rule */
+        memcpy(brks, saved_brks, BRKS_SIZE(text_len));
+        t1 = pctimer();
+        break_text_parallel(buffer, brks, widths, 0, text_len, &null_sink,
+                            threads);
+        t = (pctimer() - t1) * 1e9 / text_len;
+        if (i == 0 || t < best)
+            best = t;
+    }
+    return best;
+}
+
+static void put_utf8(unsigned long c, FILE *fp)
+{
+    if (c < 0x80)
+    {
+        putc((int)c, fp);
+    }
+    else if (c < 0x800)
+    {
+        putc((int)(0xC0 | c >> 6), fp);
+        putc((int)(0x80 | (c & 0x3F)), fp);
+    }
+    else
+    {
+        putc((int)(0xE0 | c >> 12), fp);
+        putc((int)(0x80 | (c >> 6 & 0x3F)), fp);
+        putc((int)(0x80 | (c & 0x3F)), fp);
+    }
+}
+
+static void write_text(const char *dir, const struct pattern *pat)
+{
+    char path[1024];
+    FILE *fp;
+    size_t i;
+
+    sprintf(path, "%.900s/%s.txt", dir, pat->name);
+    if ( (fp = fopen(path, "wb")) == NULL)
+    {
+        perror("Cannot write corpus file");
+        exit(1);
+    }
+    for (i = 0; i < text_len; ++i)
+        put_utf8((unsigned long)buffer[i], fp);
+    fclose(fp);
+}
+
+/* Allocate buffer, brks, and widths of breaktext.c for "chars"
+ * characters */
+static void alloc_text(size_t chars)
+{
+    buffer = calloc(chars, sizeof(wchar_t));
+    brks = calloc(BRKS_SIZE(chars), 1);
+    widths = calloc(chars, 1);
+    if (buffer == NULL || brks == NULL || widths == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct hyphen_trie *trie;
+    double small, large;
+    size_t p, c;
+    int attempt;
+    int failures = 0;
+
+    init_linebreak();
+    alloc_text(LARGE_CHARS);
+    if ( (saved_brks = malloc(BRKS_SIZE(LARGE_CHARS))) == NULL)
+    {
+        fprintf(stderr, "Out of memory\n");
+        exit(1);
+    }
+    if (hyphen_compile(hyphen_patterns, wcslen(hyphen_patterns),
+                       "stress.hyp") < 0 ||
+            (trie = hyphen_load("stress.hyp")) == NULL)
+    {
+        perror("Cannot make hyphenation file");
+        exit(1);
+    }
+    remove("stress.hyp");
+    short_lines = 1;
+
+    printf("%-14s %5s %2s %2s %2s %10s %10s %6s\n", "Input", "Width",
+           "-i", "-h", "-j", "Small/char", "Large/char", "Ratio");
+    for (p = 0; p < sizeof patterns / sizeof patterns[0]; ++p)
+    {
+        for (c = 0; c < sizeof configs / sizeof configs[0]; ++c)
+        {
+            width = configs[c].width;
+            keep_indent = configs[c].keep_indent;
+            hyphen_trie = configs[c].hyphenate ? trie : NULL;
+            /* Measure again if the machine was busy */
+            for (attempt = 0; attempt < ATTEMPTS; ++attempt)
+            {
+                make_text(&patterns[p], SMALL_CHARS);
+                small = time_layout(configs[c].threads);
+                make_text(&patterns[p], LARGE_CHARS);
+                large = time_layout(configs[c].threads);
+                if (large <= small * MAXRATIO)
+                    break;
+            }
+            printf("%-14s %5d %2s %2s %2d %7.2f ns %7.2f ns %6.2f%s\n",
+                   patterns[p].name, width, keep_indent ? "y" : "n",
+                   hyphen_trie ? "y" : "n", configs[c].threads, small,
+                   large, large / small,
+                   large > small * MAXRATIO ? "  SUPERLINEAR" : "");
+            if (large > small * MAXRATIO)
+                ++failures;
+        }
+        if (argc > 1)
+            write_text(argv[1], &patterns[p]);
+    }
+
+    hyphen_unload(trie);
+    free(saved_brks);
+    if (failures)
+    {
+        printf("%d case(s) grew superlinearly\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * trace.c: timeline of the stages in the Chrome trace event format
+ *
+ * The events are written as they come, in the JSON object format, so
+ * that nothing needs to be kept in memory.  The names passed in are
+ * written as they are, and must not need escaping.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include "pctimer.h"
+#include "trace.h"
+
+static FILE *trace_fp;
+static double trace_origin;
+static const char *trace_sep;
+
+int trace_open(const char *filename)
+{
+    if ( (trace_fp = fopen(filename, "w")) == NULL)
+        return -1;
+    trace_origin = pctimer();
+    trace_sep = "";
+    fprintf(trace_fp, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [");
+    return 0;
+}
+
+int trace_enabled(void)
+{
+    return trace_fp != NULL;
+}
+
+void trace_thread_name(int tid, const char *name)
+{
+    if (trace_fp == NULL)
+        return;
+    fprintf(trace_fp, "%s\n{\"name\": \"thread_name\", \"ph\": \"M\", "
+                      "\"pid\": 1, \"tid\": %d, "
+                      "\"args\": {\"name\": \"%s\"}}",
+            trace_sep, tid, name);
+    trace_sep = ",";
+}
+
+void trace_span(const char *name, int tid, double begin, double end,
+                const char *args, ...)
+{
+    va_list ap;
+
+    if (trace_fp == NULL)
+        return;
+    fprintf(trace_fp, "%s\n{\"name\": \"%s\", \"ph\": \"X\", "
+                      "\"pid\": 1, \"tid\": %d, "
+                      "\"ts\": %.0f, \"dur\": %.0f",
+            trace_sep, name, tid, (begin - trace_origin) * 1e6,
+            (end - begin) * 1e6);
+    if (args)
+    {
+        fprintf(trace_fp, ", \"args\": {");
+        va_start(ap, args);
+        vfprintf(trace_fp, args, ap);
+        va_end(ap);
+        fprintf(trace_fp, "}");
+    }
+    fprintf(trace_fp, "}");
+    trace_sep = ",";
+}
+
+int trace_close(void)
+{
+    int result;
+
+    if (trace_fp == NULL)
+        return 0;
+    fprintf(trace_fp, "\n]}\n");
+    result = ferror(trace_fp) | fclose(trace_fp);
+    trace_fp = NULL;
+    return result ? -1 : 0;
+}
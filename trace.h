@@ -0,0 +1,39 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * trace.h: timeline of the stages in the Chrome trace event format
+ *
+ * The file can be loaded into chrome://tracing or ui.perfetto.dev.  Each
+ * span is a complete ("X") event, on the row of the thread that ran it.
+ * The functions are not thread-safe: the spans of other threads are to
+ * be timed there, and written by the main thread.
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+/*
+ * Start writing the trace to "filename".  Times are taken from pctimer,
+ * and shown from the time of this call.  Returns -1 with errno set on
+ * failure.
+ */
+int trace_open(const char *filename);
+
+/* Nonzero if a trace is being written */
+int trace_enabled(void);
+
+/* Name the row of thread "tid" (0 for the main thread) */
+void trace_thread_name(int tid, const char *name);
+
+/*
+ * Write a span of thread "tid" from "begin" to "end" (in seconds).  If
+ * "args" is not NULL, it is the format of the members of the "args"
+ * object of the event, like "\"chars\": %lu", and the values follow.
+ */
+void trace_span(const char *name, int tid, double begin, double end,
+                const char *args, ...);
+
+/* Finish the trace.  Returns -1 if it could not be written. */
+int trace_close(void);
+
+#endif /* TRACE_H */
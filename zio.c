@@ -0,0 +1,499 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * zio.c: streaming decompression of input and compression of output
+ */
+
+#define _GNU_SOURCE             /* For fopencookie */
+#include <stdlib.h>
+#include <string.h>
+#include "zio.h"
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#define ZIO_BUFSIZE (64*1024)
+
+struct zio
+{
+    int format;
+    int writing;
+    int fd;                     /* Input */
+    FILE *fp;                   /* Output */
+    int flush_each;
+    int eof;
+    int frame_end;              /* The last frame is complete */
+    int out_full;               /* The last read filled the buffer */
+    int zlib_ready;             /* z_stream is initialized */
+    const char *error;
+    unsigned char *buf;
+    size_t pos;                 /* Unused input in buf[pos..end) */
+    size_t end;
+#ifdef HAVE_ZLIB
+    z_stream zs;
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_DCtx *dctx;
+    ZSTD_CCtx *cctx;
+#endif
+};
+
+static const char *format_names[] = {"none", "gzip", "zstd"};
+
+const char *zio_format_name(int format)
+{
+    return format_names[format];
+}
+
+int zio_find_format(const char *name)
+{
+#ifdef HAVE_ZLIB
+    if (strcmp(name, "gzip") == 0)
+        return ZIO_GZIP;
+#endif
+#ifdef HAVE_ZSTD
+    if (strcmp(name, "zstd") == 0)
+        return ZIO_ZSTD;
+#endif
+    (void)name;
+    return -1;
+}
+
+int zio_detect(const void *bytes, size_t len)
+{
+    const unsigned char *s = bytes;
+
+    if (len >= 2 && s[0] == 0x1F && s[1] == 0x8B)
+        return ZIO_GZIP;
+    if (len >= 4 && s[0] == 0x28 && s[1] == 0xB5 && s[2] == 0x2F &&
+            s[3] == 0xFD)
+        return ZIO_ZSTD;
+    return ZIO_NONE;
+}
+
+static struct zio *zio_alloc(void)
+{
+    struct zio *z;
+
+    if ( (z = calloc(1, sizeof(struct zio))) == NULL)
+        return NULL;
+    if ( (z->buf = malloc(ZIO_BUFSIZE)) == NULL)
+    {
+        free(z);
+        return NULL;
+    }
+    z->fd = -1;
+    return z;
+}
+
+static void zio_free(struct zio *z)
+{
+#ifdef HAVE_ZLIB
+    if (z->zlib_ready)
+    {
+        if (z->writing)
+            deflateEnd(&z->zs);
+        else
+            inflateEnd(&z->zs);
+    }
+#endif
+#ifdef HAVE_ZSTD
+    ZSTD_freeDCtx(z->dctx);
+    ZSTD_freeCCtx(z->cctx);
+#endif
+    free(z->buf);
+    free(z);
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_ZSTD)
+/* Read more input into buf, if all of it has been used */
+static void fill(struct zio *z)
+{
+    long count;
+
+    if (z->pos < z->end || z->eof)
+        return;
+    count = (long)read(z->fd, z->buf, ZIO_BUFSIZE);
+    if (count <= 0)
+    {
+        if (count < 0)
+            z->error = "cannot read input";
+        z->eof = 1;
+        count = 0;
+    }
+    z->pos = 0;
+    z->end = (size_t)count;
+}
+#endif
+
+struct zio *zio_open_reader(int fd)
+{
+    struct zio *z;
+    long count;
+
+    if ( (z = zio_alloc()) == NULL)
+        return NULL;
+    z->fd = fd;
+    z->frame_end = 1;
+
+    /* Read enough for the magic bytes */
+    while (z->end < 4)
+    {
+        count = (long)read(fd, z->buf + z->end, 4 - z->end);
+        if (count <= 0)
+        {
+            z->eof = 1;
+            break;
+        }
+        z->end += (size_t)count;
+    }
+
+    z->format = zio_detect(z->buf, z->end);
+    if (z->format == ZIO_GZIP)
+    {
+#ifdef HAVE_ZLIB
+        /* Accept gzip (or zlib) headers */
+        if (inflateInit2(&z->zs, 15 + 32) == Z_OK)
+            z->zlib_ready = 1;
+        else
+            z->error = "cannot initialize zlib";
+#else
+        z->error = "gzip is not supported";
+#endif
+    }
+    else if (z->format == ZIO_ZSTD)
+    {
+#ifdef HAVE_ZSTD
+        if ( (z->dctx = ZSTD_createDCtx()) == NULL)
+            z->error = "cannot initialize zstd";
+#else
+        z->error = "zstd is not supported";
+#endif
+    }
+    return z;
+}
+
+struct zio *zio_open_writer(FILE *fp, int format, int flush_each)
+{
+    struct zio *z;
+
+    if ( (z = zio_alloc()) == NULL)
+        return NULL;
+    z->format = format;
+    z->writing = 1;
+    z->fp = fp;
+    z->flush_each = flush_each;
+#ifdef HAVE_ZLIB
+    if (format == ZIO_GZIP)
+    {
+        if (deflateInit2(&z->zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16,
+                         8, Z_DEFAULT_STRATEGY) == Z_OK)
+            z->zlib_ready = 1;
+        else
+            z->error = "cannot initialize zlib";
+    }
+#endif
+#ifdef HAVE_ZSTD
+    if (format == ZIO_ZSTD && (z->cctx = ZSTD_createCCtx()) == NULL)
+        z->error = "cannot initialize zstd";
+#endif
+    return z;
+}
+
+int zio_format(const struct zio *z)
+{
+    return z->format;
+}
+
+int zio_fd(const struct zio *z)
+{
+    return z->fd;
+}
+
+int zio_pending(const struct zio *z)
+{
+    return z->pos < z->end || z->out_full;
+}
+
+const char *zio_error(const struct zio *z)
+{
+    return z->error;
+}
+
+#ifdef HAVE_ZLIB
+static long gzip_read(struct zio *z, void *buf, size_t len)
+{
+    int ret;
+
+    z->zs.next_out = buf;
+    z->zs.avail_out = (uInt)len;
+    while (z->zs.avail_out == len)
+    {
+        fill(z);
+        if (z->pos == z->end)
+        {
+            if (!z->frame_end)
+                z->error = "unexpected end of compressed input";
+            break;
+        }
+        if (z->frame_end)
+        {   /* Another gzip member follows */
+            inflateReset(&z->zs);
+            z->frame_end = 0;
+        }
+        z->zs.next_in = z->buf + z->pos;
+        z->zs.avail_in = (uInt)(z->end - z->pos);
+        ret = inflate(&z->zs, Z_NO_FLUSH);
+        z->pos = z->end - z->zs.avail_in;
+        if (ret == Z_STREAM_END)
+        {
+            z->frame_end = 1;
+        }
+        else if (ret != Z_OK && ret != Z_BUF_ERROR)
+        {
+            z->error = z->zs.msg ? z->zs.msg : "invalid compressed input";
+            break;
+        }
+    }
+    z->out_full = z->zs.avail_out == 0;
+    return z->error ? -1 : (long)(len - z->zs.avail_out);
+}
+
+static long gzip_write(struct zio *z, const void *buf, size_t len,
+                       int flush)
+{
+    size_t count;
+    int ret;
+
+    z->zs.next_in = (Bytef *)buf;
+    z->zs.avail_in = (uInt)len;
+    do
+    {
+        z->zs.next_out = z->buf;
+        z->zs.avail_out = ZIO_BUFSIZE;
+        ret = deflate(&z->zs, flush);
+        if (ret == Z_STREAM_ERROR)
+        {
+            z->error = "cannot compress output";
+            return -1;
+        }
+        count = ZIO_BUFSIZE - z->zs.avail_out;
+        if (fwrite(z->buf, 1, count, z->fp) != count)
+        {
+            z->error = "cannot write output";
+            return -1;
+        }
+    } while (z->zs.avail_out == 0 || z->zs.avail_in > 0);
+    return (long)len;
+}
+#endif /* HAVE_ZLIB */
+
+#ifdef HAVE_ZSTD
+static long zstd_read(struct zio *z, void *buf, size_t len)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    out.dst = buf;
+    out.size = len;
+    out.pos = 0;
+    while (out.pos == 0)
+    {
+        fill(z);
+        if (z->pos == z->end && z->frame_end)
+            break;
+        if (z->pos == z->end && z->eof)
+        {
+            z->error = "unexpected end of compressed input";
+            break;
+        }
+        in.src = z->buf;
+        in.size = z->end;
+        in.pos = z->pos;
+        ret = ZSTD_decompressStream(z->dctx, &out, &in);
+        z->pos = in.pos;
+        if (ZSTD_isError(ret))
+        {
+            z->error = ZSTD_getErrorName(ret);
+            break;
+        }
+        z->frame_end = ret == 0;
+    }
+    z->out_full = out.pos == out.size;
+    return z->error ? -1 : (long)out.pos;
+}
+
+static long zstd_write(struct zio *z, const void *buf, size_t len,
+                       ZSTD_EndDirective mode)
+{
+    ZSTD_inBuffer in;
+    ZSTD_outBuffer out;
+    size_t ret;
+
+    in.src = buf;
+    in.size = len;
+    in.pos = 0;
+    do
+    {
+        out.dst = z->buf;
+        out.size = ZIO_BUFSIZE;
+        out.pos = 0;
+        ret = ZSTD_compressStream2(z->cctx, &out, &in, mode);
+        if (ZSTD_isError(ret))
+        {
+            z->error = ZSTD_getErrorName(ret);
+            return -1;
+        }
+        if (fwrite(z->buf, 1, out.pos, z->fp) != out.pos)
+        {
+            z->error = "cannot write output";
+            return -1;
+        }
+    } while (mode == ZSTD_e_continue ? in.pos < in.size : ret != 0);
+    return (long)len;
+}
+#endif /* HAVE_ZSTD */
+
+long zio_read(struct zio *z, void *buf, size_t len)
+{
+    size_t count;
+
+    if (z->error)
+        return -1;
+    switch (z->format)
+    {
+#ifdef HAVE_ZLIB
+    case ZIO_GZIP:
+        return gzip_read(z, buf, len);
+#endif
+#ifdef HAVE_ZSTD
+    case ZIO_ZSTD:
+        return zstd_read(z, buf, len);
+#endif
+    default:
+        break;
+    }
+
+    /* Return the bytes read for detection first */
+    if (z->pos < z->end)
+    {
+        count = z->end - z->pos < len ? z->end - z->pos : len;
+        memcpy(buf, z->buf + z->pos, count);
+        z->pos += count;
+        return (long)count;
+    }
+    return (long)read(z->fd, buf, len);
+}
+
+long zio_write(struct zio *z, const void *buf, size_t len)
+{
+    long result = -1;
+
+    if (z->error)
+        return -1;
+    switch (z->format)
+    {
+#ifdef HAVE_ZLIB
+    case ZIO_GZIP:
+        result = gzip_write(z, buf, len,
+                            z->flush_each ? Z_SYNC_FLUSH : Z_NO_FLUSH);
+        break;
+#endif
+#ifdef HAVE_ZSTD
+    case ZIO_ZSTD:
+        result = zstd_write(z, buf, len,
+                            z->flush_each ? ZSTD_e_flush : ZSTD_e_continue);
+        break;
+#endif
+    default:
+        result = fwrite(buf, 1, len, z->fp) == len ? (long)len : -1;
+        break;
+    }
+    if (result >= 0 && z->flush_each && fflush(z->fp) != 0)
+        result = -1;
+    return result;
+}
+
+int zio_close(struct zio *z)
+{
+    int result = z->error ? -1 : 0;
+
+    if (z->writing)
+    {
+#ifdef HAVE_ZLIB
+        if (z->format == ZIO_GZIP && result == 0 &&
+                gzip_write(z, NULL, 0, Z_FINISH) < 0)
+            result = -1;
+#endif
+#ifdef HAVE_ZSTD
+        if (z->format == ZIO_ZSTD && result == 0 &&
+                zstd_write(z, NULL, 0, ZSTD_e_end) < 0)
+            result = -1;
+#endif
+        if ((z->fp == stdout ? fflush(z->fp) : fclose(z->fp)) != 0)
+            result = -1;
+    }
+    zio_free(z);
+    return result;
+}
+
+#if defined(__GLIBC__)
+
+static ssize_t cookie_write(void *cookie, const char *buf, size_t size)
+{
+    /* 0 means an error to fopencookie */
+    return zio_write(cookie, buf, size) < 0 ? 0 : (ssize_t)size;
+}
+
+static int cookie_close(void *cookie)
+{
+    return zio_close(cookie);
+}
+
+FILE *zio_fopen(struct zio *z)
+{
+    cookie_io_functions_t io;
+
+    memset(&io, 0, sizeof io);
+    io.write = cookie_write;
+    io.close = cookie_close;
+    return fopencookie(z, "w", io);
+}
+
+#elif defined(__APPLE__) || defined(__FreeBSD__) || defined(__NetBSD__) || \
+      defined(__OpenBSD__)
+
+static int cookie_write(void *cookie, const char *buf, int size)
+{
+    return (int)zio_write(cookie, buf, (size_t)size);
+}
+
+static int cookie_close(void *cookie)
+{
+    return zio_close(cookie);
+}
+
+FILE *zio_fopen(struct zio *z)
+{
+    return funopen(z, NULL, cookie_write, NULL, cookie_close);
+}
+
+#else
+
+FILE *zio_fopen(struct zio *z)
+{
+    (void)z;
+    return NULL;
+}
+
+#endif
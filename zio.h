@@ -0,0 +1,80 @@
+/* vim: set et sts=4 sw=4: */
+
+/*
+ * zio.h: streaming decompression of input and compression of output
+ *
+ * gzip is supported with zlib (HAVE_ZLIB), and zstd with libzstd
+ * (HAVE_ZSTD).  Compressed input is detected by its magic bytes, and
+ * other input is passed through.
+ */
+
+#ifndef ZIO_H
+#define ZIO_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+#define ZIO_NONE    0
+#define ZIO_GZIP    1
+#define ZIO_ZSTD    2
+
+struct zio;
+
+/* Format of data starting with "bytes[len]" (at least 4 for zstd) */
+int zio_detect(const void *bytes, size_t len);
+
+/*
+ * Start reading from "fd".  The first bytes are read to detect the
+ * format.  Returns NULL if out of memory; otherwise zio_error tells
+ * whether the format is supported.
+ */
+struct zio *zio_open_reader(int fd);
+
+/*
+ * Start writing to "fp" in "format".  If "flush_each" is nonzero, each
+ * write is flushed, so that the output can be decompressed as it
+ * comes.  Returns NULL if out of memory.
+ */
+struct zio *zio_open_writer(FILE *fp, int format, int flush_each);
+
+int zio_format(const struct zio *z);
+
+/* Name of the format, like "gzip" */
+const char *zio_format_name(int format);
+
+/* Format with the name "name", or -1 if not supported */
+int zio_find_format(const char *name);
+
+/* The file descriptor read from, for poll */
+int zio_fd(const struct zio *z);
+
+/* Nonzero if zio_read may return data without reading the file */
+int zio_pending(const struct zio *z);
+
+/*
+ * Read up to "len" decompressed bytes, waiting for no more input than
+ * is needed to return some.  Returns the number of bytes, 0 at the end
+ * of input, or -1 on error.
+ */
+long zio_read(struct zio *z, void *buf, size_t len);
+
+/* Compress and write "len" bytes.  Returns "len", or -1 on error. */
+long zio_write(struct zio *z, const void *buf, size_t len);
+
+/* Message of the last error, or NULL */
+const char *zio_error(const struct zio *z);
+
+/*
+ * Finish the output of a writer, and free "z".  The file written to is
+ * closed, unless it is stdout.  Returns 0 on success, or -1 on error.
+ */
+int zio_close(struct zio *z);
+
+/*
+ * Open a stdio stream writing to the writer "z", which is closed with
+ * the stream.  Returns NULL if custom streams are not supported by the
+ * C library.  The stream may be byte-oriented only, as with glibc.
+ */
+FILE *zio_fopen(struct zio *z);
+
+#endif /* ZIO_H */